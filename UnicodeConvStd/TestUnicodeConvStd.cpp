@@ -4,12 +4,17 @@
 ////////////////////////////////////////////////////////////////////////////////
 
 
+// Test the kernel selection telemetry too
+#define UNICODECONVSTD_KERNEL_TELEMETRY
 #include "UnicodeConvStd.hpp"   // Module to test
 
 #include <crtdbg.h>             // _ASSERTE
 
 #include <iostream>             // For console output
 #include <string>               // std::string, std::wstring
+#include <type_traits>          // std::is_same_v
+#include <unordered_map>        // std::unordered_map
+#include <vector>               // std::vector
 
 
 // Convenient function to print PASSED/FAILED on a single test,
@@ -80,6 +85,639 @@ void TestStringLengths()
 }
 
 
+void TestJsonUnescape()
+{
+    // Escapes, a raw UTF-8 kanji (U+5B66), and an escaped surrogate pair
+    // for U+1F600 (grinning face emoji); long enough to exercise bulk copies
+    const std::string json =
+        "Plain ASCII text run, then escapes: \\\"q\\\" \\t \\/ \\\\ "
+        "kanji \xE5\xAD\xA6 escaped \\u5b66 emoji \\uD83D\\uDE00 end";
+    const std::wstring expected =
+        L"Plain ASCII text run, then escapes: \"q\" \t / \\ "
+        L"kanji \x5B66 escaped \x5B66 emoji \xD83D\xDE00 end";
+
+    std::wstring utf16 = UnicodeConvStd::JsonUnescapeToUtf16(json);
+    _ASSERTE(utf16 == expected);
+    Check(utf16 == expected, "JSON unescape to UTF-16");
+
+    bool unpairedSurrogateThrows = false;
+    try
+    {
+        utf16 = UnicodeConvStd::JsonUnescapeToUtf16("\\uD83D alone");
+    }
+    catch (const UnicodeConvStd::UnicodeConversionException& e)
+    {
+        unpairedSurrogateThrows = (e.GetErrorCode() == ERROR_NO_UNICODE_TRANSLATION);
+    }
+    _ASSERTE(unpairedSurrogateThrows);
+    Check(unpairedSurrogateThrows, "JSON unescape with unpaired surrogate");
+}
+
+
+void TestPercentEncoding()
+{
+    // U+5B66 kanji is E5 AD A6 in UTF-8, U+1F600 emoji is F0 9F 98 80
+    const std::wstring utf16 = L"/docs/caf\x00E9 & more/\x5B66?q=\xD83D\xDE00~ok";
+
+    const std::string component = UnicodeConvStd::ToUtf8PercentEncoded(utf16);
+    const std::string expectedComponent =
+        "%2Fdocs%2Fcaf%C3%A9%20%26%20more%2F%E5%AD%A6%3Fq%3D%F0%9F%98%80~ok";
+    _ASSERTE(component == expectedComponent);
+    Check(component == expectedComponent, "Percent-encoding of URL component");
+
+    const std::string path = UnicodeConvStd::ToUtf8PercentEncoded(
+        utf16, UnicodeConvStd::PercentEncodingCharset::Path);
+    const std::string expectedPath = "/docs/caf%C3%A9%20&%20more/%E5%AD%A6%3Fq=%F0%9F%98%80~ok";
+    _ASSERTE(path == expectedPath);
+    Check(path == expectedPath, "Percent-encoding of URL path");
+
+    // Decoding also accepts raw (unescaped) UTF-8 sequences
+    const std::wstring decoded = UnicodeConvStd::ToUtf16PercentDecoded(component);
+    const std::wstring decodedMixed = UnicodeConvStd::ToUtf16PercentDecoded(
+        "%2Fdocs/caf\xC3\xA9 & more/%E5%AD%a6?q=%F0%9F%98%80~ok");
+    _ASSERTE(decoded == utf16 && decodedMixed == utf16);
+    Check(decoded == utf16 && decodedMixed == utf16, "Percent-decoding to UTF-16");
+}
+
+
+void TestHtmlEscaping()
+{
+    const std::wstring utf16 = L"<p class=\"note\">Tom & Jerry's \x5B66 \xD83D\xDE00</p>";
+    const std::string expected =
+        "&lt;p class=&quot;note&quot;&gt;Tom &amp; Jerry&#39;s \xE5\xAD\xA6 \xF0\x9F\x98\x80&lt;/p&gt;";
+
+    const std::string utf8 = UnicodeConvStd::ToUtf8HtmlEscaped(utf16);
+    _ASSERTE(utf8 == expected);
+    Check(utf8 == expected, "HTML escaping to UTF-8");
+}
+
+
+void TestConversionWithHash()
+{
+    using UnicodeConvStd::HashAlgorithm;
+
+    // Known answers for the ASCII string "123456789"
+    const bool knownHashes =
+        UnicodeConvStd::ToUtf8WithHash(L"123456789", HashAlgorithm::Crc32c).hash == 0xE3069283
+        && UnicodeConvStd::HashUtf8("", HashAlgorithm::XxHash64) == 0xEF46DB3751D8E999
+        && UnicodeConvStd::HashUtf8("", HashAlgorithm::Fnv1a64) == 0xCBF29CE484222325;
+    _ASSERTE(knownHashes);
+    Check(knownHashes, "Known hash values");
+
+    // Long enough to be converted and hashed in several blocks
+    std::wstring utf16;
+    for (int i = 0; i < 2000; ++i)
+    {
+        utf16 += L"Japanese kanji \x5B66, emoji \xD83D\xDE00 ";
+    }
+
+    bool matchingHashes = true;
+    for (auto algorithm : { HashAlgorithm::Fnv1a64, HashAlgorithm::XxHash64, HashAlgorithm::Crc32c })
+    {
+        const UnicodeConvStd::Utf8WithHash result = UnicodeConvStd::ToUtf8WithHash(utf16, algorithm);
+        matchingHashes = matchingHashes
+            && result.utf8 == UnicodeConvStd::ToUtf8(utf16)
+            && result.hash == UnicodeConvStd::HashUtf8(result.utf8, algorithm);
+    }
+    _ASSERTE(matchingHashes);
+    Check(matchingHashes, "Conversion with hash");
+}
+
+
+void TestCrossEncodingLookup()
+{
+    const std::wstring utf16 = L"Japanese kanji \x5B66 and emoji \xD83D\xDE00, long enough for SIMD";
+    const std::string utf8 = UnicodeConvStd::ToUtf8(utf16);
+
+    const UnicodeConvStd::Utf8Hash hash;
+    const UnicodeConvStd::Utf8Equal equal;
+
+    const bool sameHash = hash(utf16) == hash(utf8);
+    _ASSERTE(sameHash);
+    Check(sameHash, "Cross-encoding hash");
+
+    const std::wstring different = L"Japanese kanji \x5B67 and emoji \xD83D\xDE00, long enough for SIMD";
+    const bool equality = equal(utf8, utf16) && equal(utf16, utf8)
+        && !equal(utf8, different) && !equal(utf8, L"Japanese kanji");
+    _ASSERTE(equality);
+    Check(equality, "Cross-encoding equality");
+
+#if _MSVC_LANG >= 202002L
+    // Heterogeneous lookup in unordered containers is available since C++20
+    std::unordered_map<std::string, int, UnicodeConvStd::Utf8Hash, UnicodeConvStd::Utf8Equal> map;
+    map[utf8] = 1;
+    const bool found = map.find(std::wstring_view{ utf16 }) != map.end();
+    _ASSERTE(found);
+    Check(found, "Lookup of UTF-8 key with UTF-16 text");
+#endif
+}
+
+
+void TestCrossEncodingComparisons()
+{
+    using UnicodeConvStd::Compare;
+
+    const std::wstring utf16 = L"Japanese kanji \x5B66 and emoji \xD83D\xDE00 in a long enough text";
+    const std::string utf8 = UnicodeConvStd::ToUtf8(utf16);
+
+    const bool equal = UnicodeConvStd::Equal(utf16, utf8) && UnicodeConvStd::Equal(utf8, utf16)
+        && !UnicodeConvStd::Equal(utf16, utf8.substr(1));
+    _ASSERTE(equal);
+    Check(equal, "Cross-encoding Equal");
+
+    // U+FF5E sorts before U+1F600 in code point order,
+    // but after it (0xD83D) in UTF-16 code unit order
+    const bool compare = Compare(utf16, utf8) == 0
+        && Compare(L"abc", "abd") < 0 && Compare("abd", L"abc") > 0
+        && Compare(L"ab", "abc") < 0 && Compare(L"abc", "ab") > 0
+        && Compare(L"\xFF5E", "\xF0\x9F\x98\x80") < 0;
+    _ASSERTE(compare);
+    Check(compare, "Cross-encoding Compare");
+
+    const bool startsEnds =
+        UnicodeConvStd::StartsWith(utf16, "Japanese kanji \xE5\xAD\xA6")
+        && UnicodeConvStd::StartsWith(utf8, L"Japanese")
+        && !UnicodeConvStd::StartsWith(utf16, "Japanese kanji \xE5\xAD\xA7")
+        && UnicodeConvStd::EndsWith(utf16, "emoji \xF0\x9F\x98\x80 in a long enough text")
+        && UnicodeConvStd::EndsWith(utf8, L"\x5B66 and emoji \xD83D\xDE00 in a long enough text")
+        && !UnicodeConvStd::EndsWith(utf8, L"\xD83D\xDE01 in a long enough text");
+    _ASSERTE(startsEnds);
+    Check(startsEnds, "Cross-encoding StartsWith and EndsWith");
+}
+
+
+void TestCrossEncodingFind()
+{
+    const std::wstring utf16 =
+        L"Log line with emoji \xD83D\xDE00 and kanji \x5B66, then the needle: \x5B66\x7FD2 here";
+    const std::string utf8 = UnicodeConvStd::ToUtf8(utf16);
+
+    const UnicodeConvStd::FindResult found = UnicodeConvStd::Find(utf8, L"\x5B66\x7FD2 here");
+    const UnicodeConvStd::FindResult notFound = UnicodeConvStd::Find(utf8, L"\x5B66\x7FD2 there");
+
+    const bool findOk = found.Found()
+        && found.utf16Offset == utf16.find(L"\x5B66\x7FD2 here")
+        && found.utf8Offset == utf8.find("\xE5\xAD\xA6\xE7\xBF\x92 here")
+        && !notFound.Found();
+    _ASSERTE(findOk);
+    Check(findOk, "Find UTF-16 needle in UTF-8 haystack");
+}
+
+
+void TestViews()
+{
+    using UnicodeConvStd::Utf8View;
+    using UnicodeConvStd::Utf16View;
+
+    const std::wstring utf16 = L"Kanji \x5B66, emoji \xD83D\xDE00!";
+    const std::string utf8 = UnicodeConvStd::ToUtf8(utf16);
+
+    const std::u32string expectedCodePoints = U"Kanji \x5B66, emoji \x1F600!";
+    const std::u32string codePoints8(Utf8View(utf8).begin(), Utf8View(utf8).end());
+    const std::u32string codePoints16(Utf16View(utf16).begin(), Utf16View(utf16).end());
+    _ASSERTE(codePoints8 == expectedCodePoints && codePoints16 == expectedCodePoints);
+    Check(codePoints8 == expectedCodePoints && codePoints16 == expectedCodePoints,
+        "Code point views");
+
+    std::wstring transcoded16;
+    for (wchar_t unit : Utf8View(utf8) | UnicodeConvStd::AsUtf16)
+    {
+        transcoded16 += unit;
+    }
+    const UnicodeConvStd::Utf16AsUtf8View utf8View = Utf16View(utf16) | UnicodeConvStd::AsUtf8;
+    const std::string transcoded8(utf8View.begin(), utf8View.end());
+    _ASSERTE(transcoded16 == utf16 && transcoded8 == utf8);
+    Check(transcoded16 == utf16 && transcoded8 == utf8, "Transcoding views");
+
+    auto it = Utf8View(utf8).begin();
+    const std::string_view asciiRun = it.TakeAsciiRun();
+    const bool asciiRunOk = asciiRun == "Kanji " && *it == 0x5B66;
+    _ASSERTE(asciiRunOk);
+    Check(asciiRunOk, "Fast-forward over ASCII run");
+}
+
+
+// Sink that collects the output of the sink-based conversions,
+// counting the blocks it receives
+template <typename StringType>
+struct CollectingSink
+{
+    StringType output;
+    int blockCount = 0;
+
+    void write(const typename StringType::value_type* data, size_t length)
+    {
+        output.append(data, length);
+        ++blockCount;
+    }
+};
+
+
+void TestSinkConversions()
+{
+    // Long enough to be sent to the sinks in several blocks
+    std::wstring utf16;
+    for (int i = 0; i < 5000; ++i)
+    {
+        utf16 += L"Japanese kanji \x5B66, emoji \xD83D\xDE00 ";
+    }
+    const std::string utf8 = UnicodeConvStd::ToUtf8(utf16);
+
+    CollectingSink<std::string> utf8Sink;
+    UnicodeConvStd::ToUtf8(utf16, utf8Sink);
+    CollectingSink<std::wstring> utf16Sink;
+    UnicodeConvStd::ToUtf16(utf8, utf16Sink);
+
+    const bool sinksOk = utf8Sink.output == utf8 && utf8Sink.blockCount > 1
+        && utf16Sink.output == utf16 && utf16Sink.blockCount > 1;
+    _ASSERTE(sinksOk);
+    Check(sinksOk, "Conversions to sinks");
+}
+
+
+void TestLineEndingNormalization()
+{
+    using UnicodeConvStd::LineEndingPolicy;
+
+    const std::wstring utf16 = L"one\r\ntwo\n\x5B66\r\n\rthree\r";
+    const bool stringsOk =
+        UnicodeConvStd::ToUtf8(utf16, LineEndingPolicy::CrLfToLf) == "one\ntwo\n\xE5\xAD\xA6\n\rthree\r"
+        && UnicodeConvStd::ToUtf8(utf16, LineEndingPolicy::LfToCrLf) == "one\r\ntwo\r\n\xE5\xAD\xA6\r\n\rthree\r"
+        && UnicodeConvStd::ToUtf8(utf16, LineEndingPolicy::Preserve) == UnicodeConvStd::ToUtf8(utf16)
+        && UnicodeConvStd::ToUtf16("a\nb\r\nc", LineEndingPolicy::LfToCrLf) == L"a\r\nb\r\nc"
+        && UnicodeConvStd::ToUtf16("a\r\nb\r", LineEndingPolicy::CrLfToLf) == L"a\nb\r";
+
+    // Long enough to be sent to the sinks in several blocks, so that
+    // some CR LF pairs are split across the block edges
+    std::wstring crlfText;
+    std::wstring lfText;
+    for (int i = 0; i < 5000; ++i)
+    {
+        crlfText += L"Kanji \x5B66\r\n";
+        lfText += L"Kanji \x5B66\n";
+    }
+    const std::string lfUtf8 = UnicodeConvStd::ToUtf8(lfText);
+
+    CollectingSink<std::string> utf8Sink;
+    UnicodeConvStd::ToUtf8(crlfText, LineEndingPolicy::CrLfToLf, utf8Sink);
+    CollectingSink<std::wstring> utf16Sink;
+    UnicodeConvStd::ToUtf16(lfUtf8, LineEndingPolicy::LfToCrLf, utf16Sink);
+
+    const bool sinksOk = utf8Sink.output == lfUtf8 && utf8Sink.blockCount > 1
+        && utf16Sink.output == crlfText && utf16Sink.blockCount > 1
+        && UnicodeConvStd::ToUtf8(crlfText, LineEndingPolicy::CrLfToLf) == lfUtf8;
+
+    const bool normalizationOk = stringsOk && sinksOk;
+    _ASSERTE(normalizationOk);
+    Check(normalizationOk, "Line ending normalization");
+}
+
+
+void TestLineIndex()
+{
+    const UnicodeConvStd::Utf8WithLineIndex indexed =
+        UnicodeConvStd::ToUtf8WithLineIndex(L"first\r\n\x5B66\n\nlast\n");
+
+    const bool lineIndexOk = indexed.utf8 == "first\r\n\xE5\xAD\xA6\n\nlast\n"
+        && indexed.lineOffsets == std::vector<size_t>{ 0, 7, 11, 12 }
+        && UnicodeConvStd::ToUtf8WithLineIndex(L"no newline").lineOffsets == std::vector<size_t>{ 0 }
+        && UnicodeConvStd::ToUtf8WithLineIndex(L"").lineOffsets.empty();
+    _ASSERTE(lineIndexOk);
+    Check(lineIndexOk, "Conversion with line index");
+}
+
+
+void TestCjkText()
+{
+    // Japanese text, with all the code points taking 3 chars in UTF-8,
+    // long enough for the fixed-stride CJK kernels
+    std::wstring utf16;
+    for (int i = 0; i < 100; ++i)
+    {
+        utf16 += L"\x65E5\x672C\x8A9E\x306E\x30C6\x30AD\x30B9\x30C8\x3002";
+    }
+    utf16 += L"\xFFFD\xE000\x0800\xD7FF";   // 3-char range boundaries
+    const std::string utf8 = UnicodeConvStd::ToUtf8(utf16);
+
+    CollectingSink<std::string> utf8Sink;
+    UnicodeConvStd::ToUtf8(utf16, utf8Sink);
+    CollectingSink<std::wstring> utf16Sink;
+    UnicodeConvStd::ToUtf16(utf8, utf16Sink);
+
+    // An encoded surrogate (ED A0 80) in the middle of the 3-char sequences
+    // must be rejected
+    std::string invalidUtf8 = utf8;
+    invalidUtf8.replace(30, 3, "\xED\xA0\x80");
+    bool invalidRejected = false;
+    try
+    {
+        CollectingSink<std::wstring> sink;
+        UnicodeConvStd::ToUtf16(invalidUtf8, sink);
+    }
+    catch (const UnicodeConvStd::UnicodeConversionException&)
+    {
+        invalidRejected = true;
+    }
+
+    const bool cjkOk = utf8Sink.output == utf8 && utf16Sink.output == utf16 && invalidRejected;
+    _ASSERTE(cjkOk);
+    Check(cjkOk, "CJK text conversions");
+}
+
+
+// Convert the text to a sink, returning true if the conversion is rejected
+template <typename StringType>
+bool IsRejectedBySink(const StringType& text)
+{
+    try
+    {
+        if constexpr (std::is_same_v<StringType, std::wstring>)
+        {
+            CollectingSink<std::string> sink;
+            UnicodeConvStd::ToUtf8(text, sink);
+        }
+        else
+        {
+            CollectingSink<std::wstring> sink;
+            UnicodeConvStd::ToUtf16(text, sink);
+        }
+    }
+    catch (const UnicodeConvStd::UnicodeConversionException&)
+    {
+        return true;
+    }
+    return false;
+}
+
+
+void TestEmojiText()
+{
+    // Emoji only (surrogate pairs in UTF-16, 4 chars in UTF-8),
+    // long enough for the surrogate pair kernels
+    std::wstring utf16;
+    for (int i = 0; i < 100; ++i)
+    {
+        utf16 += L"\xD83D\xDE00\xD83D\xDC4D\xD83C\xDF89\xD83E\xDD14";
+    }
+    utf16 += L"\xD800\xDC00\xDBFF\xDFFF";   // Supplementary range boundaries
+    const std::string utf8 = UnicodeConvStd::ToUtf8(utf16);
+
+    CollectingSink<std::string> utf8Sink;
+    UnicodeConvStd::ToUtf8(utf16, utf8Sink);
+    CollectingSink<std::wstring> utf16Sink;
+    UnicodeConvStd::ToUtf16(utf8, utf16Sink);
+
+    // Invalid sequences in the middle of a 16-unit block of surrogate pairs
+    // must be rejected: a code point above U+10FFFF (F4 90 80 80), an overlong
+    // encoding (F0 80 80 80), and unpaired high and low surrogates
+    std::string aboveMaxUtf8 = utf8;
+    aboveMaxUtf8.replace(40, 4, "\xF4\x90\x80\x80");
+    std::string overlongUtf8 = utf8;
+    overlongUtf8.replace(40, 4, "\xF0\x80\x80\x80");
+    std::wstring unpairedHigh = utf16;
+    unpairedHigh[21] = L'x';
+    std::wstring unpairedLow = utf16;
+    unpairedLow[20] = L'x';
+
+    const bool invalidRejected = IsRejectedBySink(aboveMaxUtf8) && IsRejectedBySink(overlongUtf8)
+        && IsRejectedBySink(unpairedHigh) && IsRejectedBySink(unpairedLow);
+
+    const bool emojiOk = utf8Sink.output == utf8 && utf16Sink.output == utf16 && invalidRejected;
+    _ASSERTE(emojiOk);
+    Check(emojiOk, "Emoji text conversions");
+}
+
+
+#ifdef UNICODECONVSTD_KERNEL_TELEMETRY
+void TestKernelSelection()
+{
+    using UnicodeConvStd::ConversionKernel;
+    using UnicodeConvStd::KernelSelectionCount;
+
+    // Mostly ASCII text, and Cyrillic text (2 chars per code point in UTF-8)
+    const std::wstring ascii = L"Plain ASCII text, with just an accented letter: caf\x00E9";
+    const std::wstring cyrillic = L"\x041F\x0440\x0438\x0432\x0435\x0442 \x043C\x0438\x0440";
+
+    UnicodeConvStd::ResetKernelSelectionCounts();
+    CollectingSink<std::string> asciiSink;
+    UnicodeConvStd::ToUtf8(ascii, asciiSink);
+    const bool asciiOk = KernelSelectionCount(ConversionKernel::Ascii) == 1
+        && asciiSink.output == UnicodeConvStd::ToUtf8(ascii);
+
+    CollectingSink<std::wstring> cyrillicSink;
+    UnicodeConvStd::ToUtf16(UnicodeConvStd::ToUtf8(cyrillic), cyrillicSink);
+    const bool cyrillicOk = KernelSelectionCount(ConversionKernel::Generic) == 1
+        && cyrillicSink.output == cyrillic;
+
+    // Emoji text, longer than the sample the kernel is picked from:
+    // without SSE2 there is no surrogate pair kernel to pick
+#ifdef UNICODECONVSTD_SSE2
+    const ConversionKernel emojiKernel = ConversionKernel::Supplementary;
+#else
+    const ConversionKernel emojiKernel = ConversionKernel::Generic;
+#endif
+    UnicodeConvStd::ResetKernelSelectionCounts();
+    std::wstring emoji;
+    for (int i = 0; i < 20; ++i)
+    {
+        emoji += L"\xD83D\xDE00\xD83D\xDC4D ";
+    }
+    CollectingSink<std::string> emojiUtf8Sink;
+    UnicodeConvStd::ToUtf8(emoji, emojiUtf8Sink);
+    CollectingSink<std::wstring> emojiUtf16Sink;
+    UnicodeConvStd::ToUtf16(emojiUtf8Sink.output, emojiUtf16Sink);
+    const bool emojiOk = KernelSelectionCount(emojiKernel) == 2
+        && emojiUtf16Sink.output == emoji;
+
+    // A conversion sent to the sink in several blocks picks its kernel once
+    UnicodeConvStd::ResetKernelSelectionCounts();
+    const std::wstring longAscii(100000, L'a');
+    CollectingSink<std::string> longAsciiSink;
+    UnicodeConvStd::ToUtf8(longAscii, longAsciiSink);
+    const bool onceOk = KernelSelectionCount(ConversionKernel::Ascii) == 1 && longAsciiSink.blockCount > 1;
+
+    const bool selectionOk = asciiOk && cyrillicOk && emojiOk && onceOk;
+    _ASSERTE(selectionOk);
+    Check(selectionOk, "Conversion kernel selection");
+}
+#endif // UNICODECONVSTD_KERNEL_TELEMETRY
+
+
+void TestShortStrings()
+{
+    // Strings that fit the small string buffer of the result
+    // take the short string fast path
+    const std::wstring ascii16 = L"0123456789abcdef";
+    const std::wstring latin = L"caf\x00E9";
+    const std::wstring kanji = L"\x5B66\x7FD2 \xD83D\xDE00";
+    const bool roundTripsOk = UnicodeConvStd::ToUtf16(UnicodeConvStd::ToUtf8(ascii16)) == ascii16
+        && UnicodeConvStd::ToUtf8(latin) == "caf\xC3\xA9"
+        && UnicodeConvStd::ToUtf16("caf\xC3\xA9") == latin
+        && UnicodeConvStd::ToUtf16(UnicodeConvStd::ToUtf8(kanji)) == kanji;
+
+    // Invalid input must be rejected like in the Win32 API path
+    DWORD utf16ErrorCode = 0;
+    try
+    {
+        const std::string utf8 = UnicodeConvStd::ToUtf8(std::wstring(L"unpaired \xD83D"));
+    }
+    catch (const UnicodeConvStd::UnicodeConversionException& e)
+    {
+        utf16ErrorCode = e.GetErrorCode();
+    }
+    DWORD utf8ErrorCode = 0;
+    try
+    {
+        const std::wstring utf16 = UnicodeConvStd::ToUtf16(std::string("bad \xC3"));
+    }
+    catch (const UnicodeConvStd::UnicodeConversionException& e)
+    {
+        utf8ErrorCode = e.GetErrorCode();
+    }
+
+    const bool shortStringsOk = roundTripsOk
+        && utf16ErrorCode == ERROR_NO_UNICODE_TRANSLATION && utf8ErrorCode == ERROR_NO_UNICODE_TRANSLATION;
+    _ASSERTE(shortStringsOk);
+    Check(shortStringsOk, "Short strings");
+}
+
+
+#ifdef _WIN64
+// Convert strings longer than INT_MAX code units: the Win32 API conversions
+// are split in chunks. Needs about 7 GB of memory, so it's run only
+// when requested with the --large command line option.
+void TestLargeInputs()
+{
+    constexpr size_t kLength = (size_t{1} << 31) + 8;
+
+    // U+1F600 (grinning face emoji) crossing the first chunk boundary,
+    // and U+5B66 kanji at the end
+    constexpr size_t kEmojiOffset = (size_t{1} << 29) - 1;
+    std::wstring utf16(kLength, L'a');
+    utf16[kEmojiOffset] = 0xD83D;
+    utf16[kEmojiOffset + 1] = 0xDE00;
+    utf16[kLength - 1] = 0x5B66;
+
+    const std::string utf8 = UnicodeConvStd::ToUtf8(utf16);
+    const bool utf8Ok = utf8.length() == kLength + 4
+        && utf8.compare(kEmojiOffset, 5, "\xF0\x9F\x98\x80" "a") == 0
+        && utf8.compare(utf8.length() - 4, 4, "a\xE5\xAD\xA6") == 0;
+
+    // Free the source, to keep the memory use at input plus output
+    utf16 = std::wstring{};
+
+    const std::wstring utf16Again = UnicodeConvStd::ToUtf16(utf8);
+    const bool utf16Ok = utf16Again.length() == kLength
+        && utf16Again[kEmojiOffset] == 0xD83D && utf16Again[kEmojiOffset + 1] == 0xDE00
+        && utf16Again[kLength - 2] == L'a' && utf16Again[kLength - 1] == 0x5B66;
+
+    const bool largeOk = utf8Ok && utf16Ok;
+    _ASSERTE(largeOk);
+    Check(largeOk, "Inputs larger than INT_MAX");
+}
+#endif
+
+
+void TestSegmentedOutput()
+{
+    // Small blocks, so that the output spans several of them
+    UnicodeConvStd::SegmentedOutputOptions options;
+    options.blockBytes = 4096;
+
+    std::wstring utf16;
+    for (int i = 0; i < 2000; ++i)
+    {
+        utf16 += L"Japanese kanji \x5B66, emoji \xD83D\xDE00 ";
+    }
+    const std::string utf8 = UnicodeConvStd::ToUtf8(utf16);
+
+    const UnicodeConvStd::SegmentedUtf8 segmentedUtf8 = UnicodeConvStd::ToUtf8Segmented(utf16, options);
+    const UnicodeConvStd::SegmentedUtf16 segmentedUtf16 = UnicodeConvStd::ToUtf16Segmented(utf8, options);
+
+    bool segmentsOk = segmentedUtf8.Segments().size() > 1 && segmentedUtf16.Segments().size() > 1;
+    for (const auto& segment : segmentedUtf8.Segments())
+    {
+        segmentsOk = segmentsOk && segment.length <= options.blockBytes;
+    }
+
+    // Same output with non-temporal stores
+    options.storeMode = UnicodeConvStd::OutputStoreMode::NonTemporal;
+    const bool nonTemporalOk = UnicodeConvStd::ToUtf8Segmented(utf16, options).ToString() == utf8
+        && UnicodeConvStd::ToUtf16Segmented(utf8, options).ToString() == utf16;
+
+    const bool segmentedOk = segmentsOk && nonTemporalOk
+        && segmentedUtf8.Length() == utf8.length() && segmentedUtf8.ToString() == utf8
+        && segmentedUtf16.Length() == utf16.length() && segmentedUtf16.ToString() == utf16;
+    _ASSERTE(segmentedOk);
+    Check(segmentedOk, "Segmented output");
+}
+
+
+void TestGatheredInput()
+{
+    // The kanji (3 chars in UTF-8) and the emoji (a surrogate pair, 4 chars
+    // in UTF-8) are split between segments
+    const std::wstring utf16 = L"Japanese kanji \x5B66, emoji \xD83D\xDE00!";
+    const std::string utf8 = UnicodeConvStd::ToUtf8(utf16);
+    const size_t emojiOffset = utf16.find(L'\xD83D');
+    const size_t kanjiUtf8Offset = utf8.find('\xE5');
+
+    const std::vector<std::wstring_view> utf16Segments = {
+        std::wstring_view(utf16).substr(0, emojiOffset + 1),
+        std::wstring_view(utf16).substr(emojiOffset + 1)
+    };
+    const UnicodeConvStd::TextSegment<char> utf8Segments[] = {
+        { utf8.data(), kanjiUtf8Offset + 1 },
+        { utf8.data() + kanjiUtf8Offset + 1, 1 },
+        { utf8.data() + kanjiUtf8Offset + 2, utf8.length() - kanjiUtf8Offset - 2 }
+    };
+
+    const bool contiguousOk = UnicodeConvStd::GatherToUtf8(utf16Segments) == utf8
+        && UnicodeConvStd::GatherToUtf16(utf8Segments) == utf16;
+    const bool segmentedOk = UnicodeConvStd::GatherToUtf8Segmented(utf16Segments).ToString() == utf8
+        && UnicodeConvStd::GatherToUtf16Segmented(utf8Segments).ToString() == utf16;
+
+    // A sequence truncated at the end of the last segment must be rejected
+    bool truncatedRejected = false;
+    try
+    {
+        const std::string_view truncatedSegments[] = { "abc", "\xE5\xAD" };
+        const std::wstring truncated = UnicodeConvStd::GatherToUtf16(truncatedSegments);
+    }
+    catch (const UnicodeConvStd::UnicodeConversionException&)
+    {
+        truncatedRejected = true;
+    }
+
+    const bool gatheredOk = contiguousOk && segmentedOk && truncatedRejected;
+    _ASSERTE(gatheredOk);
+    Check(gatheredOk, "Gathered input segments");
+}
+
+
+void TestLargePageOutput()
+{
+    // Large enough (over 2 MB of UTF-8) to be allocated directly from the OS;
+    // large pages are used only if the privilege is held, regular pages otherwise
+    UnicodeConvStd::EnableLargePages();
+
+    std::wstring utf16;
+    for (int i = 0; i < 100000; ++i)
+    {
+        utf16 += L"Japanese kanji \x5B66, emoji \xD83D\xDE00 ";
+    }
+    const std::string utf8 = UnicodeConvStd::ToUtf8(utf16);
+
+    const UnicodeConvStd::LargePageUtf8String largeUtf8 = UnicodeConvStd::ToUtf8LargePages(utf16);
+    const UnicodeConvStd::LargePageUtf16String largeUtf16 = UnicodeConvStd::ToUtf16LargePages(utf8);
+
+    const bool largePagesOk = std::string_view(largeUtf8) == utf8 && std::wstring_view(largeUtf16) == utf16
+        && UnicodeConvStd::ToUtf8LargePages(L"short") == "short";
+    _ASSERTE(largePagesOk);
+    Check(largePagesOk, "Large-page-backed output");
+}
+
+
 void TestUnicodeConversions()
 {
     std::cout << "*** Test Unicode UTF-16/UTF-8 std::wstring/string Conversion Functions *** \n"
@@ -89,13 +727,40 @@ void TestUnicodeConversions()
     TestEmptyStrings();
     TestStringsWithJapaneseKanji();
     TestStringLengths();
+    TestShortStrings();
+    TestJsonUnescape();
+    TestPercentEncoding();
+    TestHtmlEscaping();
+    TestConversionWithHash();
+    TestCrossEncodingLookup();
+    TestCrossEncodingComparisons();
+    TestCrossEncodingFind();
+    TestViews();
+    TestSinkConversions();
+    TestLineEndingNormalization();
+    TestLineIndex();
+    TestCjkText();
+    TestEmojiText();
+#ifdef UNICODECONVSTD_KERNEL_TELEMETRY
+    TestKernelSelection();
+#endif
+    TestSegmentedOutput();
+    TestGatheredInput();
+    TestLargePageOutput();
 }
 
 
-int main()
+int main([[maybe_unused]] int argc, [[maybe_unused]] char* argv[])
 {
     // Run the tests
     TestUnicodeConversions();
+
+#ifdef _WIN64
+    if (argc > 1 && std::string(argv[1]) == "--large")
+    {
+        TestLargeInputs();
+    }
+#endif
 }
 
 
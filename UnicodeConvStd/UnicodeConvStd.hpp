@@ -26,6 +26,71 @@
 //      * Convert from UTF-8 to UTF-16:
 //        std::wstring ToUtf16(std::string const& utf8)
 //
+//      * Decode JSON string escapes and convert from UTF-8 to UTF-16:
+//        std::wstring JsonUnescapeToUtf16(std::string_view utf8Json)
+//
+//      * Convert from UTF-16 to percent-encoded UTF-8, and back:
+//        std::string ToUtf8PercentEncoded(std::wstring_view utf16, PercentEncodingCharset charset)
+//        std::wstring ToUtf16PercentDecoded(std::string_view percentEncoded)
+//
+//      * Convert from UTF-16 to UTF-8, escaping HTML/XML special chars:
+//        std::string ToUtf8HtmlEscaped(std::wstring_view utf16)
+//
+//      * Convert from UTF-16 to UTF-8, hashing the UTF-8 bytes in the same pass:
+//        Utf8WithHash ToUtf8WithHash(std::wstring_view utf16, HashAlgorithm algorithm)
+//        std::uint64_t HashUtf8(std::string_view utf8, HashAlgorithm algorithm)
+//
+//      * Hash and equality function objects for std::string keys, that also
+//        accept UTF-16 text, for heterogeneous lookup without conversion:
+//        Utf8Hash, Utf8Equal
+//
+//      * Compare UTF-16 and UTF-8 text without converting it
+//        (with overloads for both argument orders):
+//        bool Equal(std::wstring_view utf16, std::string_view utf8)
+//        int Compare(std::wstring_view utf16, std::string_view utf8)
+//        bool StartsWith(std::wstring_view utf16Text, std::string_view utf8Prefix)
+//        bool EndsWith(std::wstring_view utf16Text, std::string_view utf8Suffix)
+//
+//      * Find UTF-16 text in UTF-8 text, without converting the UTF-8 text:
+//        FindResult Find(std::string_view utf8Haystack, std::wstring_view utf16Needle)
+//
+//      * Views to lazily iterate code points, or transcode, without allocations:
+//        Utf8View(utf8), Utf16View(utf16), Utf8View(utf8) | AsUtf16, Utf16View(utf16) | AsUtf8
+//
+//      * Convert sending the output in blocks to a sink, with no intermediate string:
+//        void ToUtf8(std::wstring_view utf16, Sink& sink)
+//        void ToUtf16(std::string_view utf8, Sink& sink)
+//
+//      * Convert to a chain of fixed-size blocks (e.g. for gather writes):
+//        SegmentedUtf8 ToUtf8Segmented(std::wstring_view utf16, SegmentedOutputOptions options)
+//        SegmentedUtf16 ToUtf16Segmented(std::string_view utf8, SegmentedOutputOptions options)
+//
+//      * Convert the text of a sequence of input segments, with no gather copy:
+//        std::string GatherToUtf8(const SegmentRange& utf16Segments)
+//        std::wstring GatherToUtf16(const SegmentRange& utf8Segments)
+//        SegmentedUtf8 GatherToUtf8Segmented(const SegmentRange& utf16Segments, options)
+//        SegmentedUtf16 GatherToUtf16Segmented(const SegmentRange& utf8Segments, options)
+//
+//      * Convert large texts to strings backed by large pages:
+//        LargePageUtf8String ToUtf8LargePages(std::wstring_view utf16)
+//        LargePageUtf16String ToUtf16LargePages(std::string_view utf8)
+//        bool EnableLargePages()
+//
+//      * Convert normalizing the line endings (CR LF to LF, or LF to CR LF)
+//        in the same pass, to a string or to a sink:
+//        std::string ToUtf8(std::wstring_view utf16, LineEndingPolicy policy)
+//        std::wstring ToUtf16(std::string_view utf8, LineEndingPolicy policy)
+//        void ToUtf8(std::wstring_view utf16, LineEndingPolicy policy, Sink& sink)
+//        void ToUtf16(std::string_view utf8, LineEndingPolicy policy, Sink& sink)
+//
+//      * Convert from UTF-16 to UTF-8, also indexing the start offset of each line:
+//        Utf8WithLineIndex ToUtf8WithLineIndex(std::wstring_view utf16)
+//
+//      * Telemetry of the conversion kernels picked by the portable engine
+//        (with UNICODECONVSTD_KERNEL_TELEMETRY defined before the #include):
+//        std::uint64_t KernelSelectionCount(ConversionKernel kernel)
+//        void ResetKernelSelectionCounts()
+//
 // These functions live under the UnicodeConvStd namespace.
 //
 // This code compiles cleanly at warning level 4 (/W4)
@@ -67,9 +132,35 @@
 
 #include <crtdbg.h>     // _ASSERTE
 
+#include <algorithm>    // std::max, std::min
+#include <array>        // std::array
+#include <atomic>       // std::atomic
+#include <cstddef>      // size_t
+#include <cstdint>      // std::uint64_t, std::uint32_t
+#include <cstring>      // std::memcpy, std::memcmp
+#include <iterator>     // std::input_iterator_tag, std::forward_iterator_tag
 #include <limits>       // std::numeric_limits
+#include <new>          // std::bad_alloc
 #include <stdexcept>    // std::runtime_error, std::overflow_error
 #include <string>       // std::string, std::wstring
+#include <string_view>  // std::string_view, std::wstring_view
+#include <type_traits>  // std::is_same_v, std::decay_t
+#include <utility>      // std::move, std::exchange
+#include <vector>       // std::vector
+
+#if _MSVC_LANG >= 202002L
+#include <ranges>       // std::ranges::enable_view, std::ranges::enable_borrowed_range
+#endif
+
+// SSE2 is always available on x64, and it's the default for x86 builds
+// since Visual Studio 2012; other targets use the portable scalar code.
+#if defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define UNICODECONVSTD_SSE2 1
+#include <intrin.h>     // _BitScanForward, __cpuid
+#include <emmintrin.h>  // SSE2 intrinsics
+#include <tmmintrin.h>  // SSSE3 shuffle intrinsics (used after a CPUID check)
+#include <nmmintrin.h>  // SSE4.2 CRC32 intrinsics (used after a CPUID check)
+#endif
 
 
 //==============================================================================
@@ -142,6 +233,42 @@ inline [[nodiscard]] int SafeToInt(size_t s)
     return static_cast<DestinationType>(s);
 }
 
+
+//------------------------------------------------------------------------------
+// Strings up to this length (in code units) can be converted by the portable
+// engine in a stack buffer, without the per-call overhead of the Win32 API
+// calls. The short string conversions are defined with the portable engine below.
+//------------------------------------------------------------------------------
+inline constexpr size_t kShortStringLength = 16;
+
+//------------------------------------------------------------------------------
+// Length of the inputs that take the short string fast path: up to the
+// small string buffer capacity of the result string type, so that the result
+// is built with no heap allocation (UTF-8 results grow past it only when
+// there are non-ASCII code points, and would be allocated on any path)
+//------------------------------------------------------------------------------
+template <typename ResultString>
+inline [[nodiscard]] size_t ShortStringLimit() noexcept
+{
+    return (std::min)(kShortStringLength, ResultString{}.capacity());
+}
+
+inline [[nodiscard]] std::string ShortToUtf8(const wchar_t* src, size_t length);
+inline [[nodiscard]] std::wstring ShortToUtf16(const char* src, size_t length);
+
+
+//------------------------------------------------------------------------------
+// Inputs too long for the int lengths of the Win32 API are converted
+// in chunks of up to this length, split at code point boundaries.
+// Even the UTF-8 output of a UTF-16 chunk (up to 3 chars per code unit)
+// fits in an int.
+// The chunked conversions are defined with the portable engine below.
+//------------------------------------------------------------------------------
+inline constexpr size_t kWin32ChunkLength = size_t{1} << 29;
+
+inline [[nodiscard]] std::string ChunkedToUtf8(const wchar_t* src, size_t length);
+inline [[nodiscard]] std::wstring ChunkedToUtf16(const char* src, size_t length);
+
 } // namespace Details
 
 
@@ -158,6 +285,18 @@ inline [[nodiscard]] std::string ToUtf8(std::wstring const& utf16)
         return std::string{};
     }
 
+    // Fast path for short strings
+    if (utf16.length() <= Details::ShortStringLimit<std::string>())
+    {
+        return Details::ShortToUtf8(utf16.data(), utf16.length());
+    }
+
+    // Inputs longer than INT_MAX are converted in chunks
+    if (utf16.length() > static_cast<size_t>((std::numeric_limits<int>::max)()))
+    {
+        return Details::ChunkedToUtf8(utf16.data(), utf16.length());
+    }
+
     // Safely fail if an invalid UTF-16 character sequence is encountered
     constexpr DWORD kFlags = WC_ERR_INVALID_CHARS;
 
@@ -225,6 +364,18 @@ inline [[nodiscard]] std::wstring ToUtf16(std::string const& utf8)
         return std::wstring{};
     }
 
+    // Fast path for short strings
+    if (utf8.length() <= Details::ShortStringLimit<std::wstring>())
+    {
+        return Details::ShortToUtf16(utf8.data(), utf8.length());
+    }
+
+    // Inputs longer than INT_MAX are converted in chunks
+    if (utf8.length() > static_cast<size_t>((std::numeric_limits<int>::max)()))
+    {
+        return Details::ChunkedToUtf16(utf8.data(), utf8.length());
+    }
+
     // Safely fail if an invalid UTF-8 character sequence is encountered
     constexpr DWORD kFlags = MB_ERR_INVALID_CHARS;
 
@@ -276,7 +427,4816 @@ inline [[nodiscard]] std::wstring ToUtf16(std::string const& utf8)
     return utf16;
 }
 
-} // namespace UnicodeConvStd
+
+//==============================================================================
+//              Portable conversion helpers (used by the fused conversions)
+//==============================================================================
+
+namespace Details
+{
+
+//------------------------------------------------------------------------------
+// Throw a UnicodeConversionException carrying the given error code.
+// Kept out of line from the conversion loops, as it's the cold path.
+//------------------------------------------------------------------------------
+[[noreturn]] inline void ThrowConversionError(
+    DWORD errorCode,
+    UnicodeConversionException::ConversionType conversionType,
+    const char* message)
+{
+    throw UnicodeConversionException(errorCode, conversionType, message);
+}
+
+
+//------------------------------------------------------------------------------
+// Decode the UTF-8 sequence starting at p (p must be before end).
+// Returns the length of the sequence in chars, storing the decoded code point
+// in codePoint; returns 0 if the sequence is ill-formed (truncated, overlong,
+// surrogate code point, or beyond U+10FFFF).
+//------------------------------------------------------------------------------
+inline [[nodiscard]] size_t DecodeUtf8(const char* p, const char* end, char32_t& codePoint) noexcept
+{
+    const unsigned int lead = static_cast<unsigned char>(p[0]);
+    if (lead < 0x80)
+    {
+        codePoint = lead;
+        return 1;
+    }
+
+    size_t length;
+    char32_t minCodePoint;
+    if (lead >= 0xC2 && lead <= 0xDF)
+    {
+        length = 2;
+        minCodePoint = 0x80;
+        codePoint = lead & 0x1F;
+    }
+    else if ((lead & 0xF0) == 0xE0)
+    {
+        length = 3;
+        minCodePoint = 0x800;
+        codePoint = lead & 0x0F;
+    }
+    else if (lead >= 0xF0 && lead <= 0xF4)
+    {
+        length = 4;
+        minCodePoint = 0x10000;
+        codePoint = lead & 0x07;
+    }
+    else
+    {
+        // Continuation byte, or lead byte that can only start overlong
+        // or out-of-range sequences
+        return 0;
+    }
+
+    if (static_cast<size_t>(end - p) < length)
+    {
+        return 0;
+    }
+
+    for (size_t i = 1; i < length; ++i)
+    {
+        const unsigned int trail = static_cast<unsigned char>(p[i]);
+        if ((trail & 0xC0) != 0x80)
+        {
+            return 0;
+        }
+        codePoint = (codePoint << 6) | (trail & 0x3F);
+    }
+
+    if (codePoint < minCodePoint
+        || codePoint > 0x10FFFF
+        || (codePoint >= 0xD800 && codePoint <= 0xDFFF))
+    {
+        return 0;
+    }
+
+    return length;
+}
+
+
+//------------------------------------------------------------------------------
+// Encode a valid Unicode code point as UTF-16.
+// Returns the number of wchar_ts written to dest (1 or 2).
+//------------------------------------------------------------------------------
+inline size_t EncodeUtf16(char32_t codePoint, wchar_t* dest) noexcept
+{
+    if (codePoint < 0x10000)
+    {
+        dest[0] = static_cast<wchar_t>(codePoint);
+        return 1;
+    }
+
+    codePoint -= 0x10000;
+    dest[0] = static_cast<wchar_t>(0xD800 + (codePoint >> 10));
+    dest[1] = static_cast<wchar_t>(0xDC00 + (codePoint & 0x3FF));
+    return 2;
+}
+
+
+//------------------------------------------------------------------------------
+// Decode the UTF-16 code point starting at p (p must be before end).
+// Returns the number of wchar_ts consumed (1 or 2), storing the decoded
+// code point in codePoint; returns 0 for unpaired surrogates.
+//------------------------------------------------------------------------------
+inline [[nodiscard]] size_t DecodeUtf16(const wchar_t* p, const wchar_t* end, char32_t& codePoint) noexcept
+{
+    const char32_t unit = p[0];
+    if (unit < 0xD800 || unit > 0xDFFF)
+    {
+        codePoint = unit;
+        return 1;
+    }
+
+    if (unit > 0xDBFF || end - p < 2 || p[1] < 0xDC00 || p[1] > 0xDFFF)
+    {
+        return 0;
+    }
+
+    codePoint = 0x10000 + ((unit - 0xD800) << 10) + (static_cast<char32_t>(p[1]) - 0xDC00);
+    return 2;
+}
+
+
+//------------------------------------------------------------------------------
+// Encode a valid Unicode code point as UTF-8.
+// Returns the number of chars written to dest (1 to 4).
+//------------------------------------------------------------------------------
+inline size_t EncodeUtf8(char32_t codePoint, char* dest) noexcept
+{
+    if (codePoint < 0x80)
+    {
+        dest[0] = static_cast<char>(codePoint);
+        return 1;
+    }
+
+    if (codePoint < 0x800)
+    {
+        dest[0] = static_cast<char>(0xC0 | (codePoint >> 6));
+        dest[1] = static_cast<char>(0x80 | (codePoint & 0x3F));
+        return 2;
+    }
+
+    if (codePoint < 0x10000)
+    {
+        dest[0] = static_cast<char>(0xE0 | (codePoint >> 12));
+        dest[1] = static_cast<char>(0x80 | ((codePoint >> 6) & 0x3F));
+        dest[2] = static_cast<char>(0x80 | (codePoint & 0x3F));
+        return 3;
+    }
+
+    dest[0] = static_cast<char>(0xF0 | (codePoint >> 18));
+    dest[1] = static_cast<char>(0x80 | ((codePoint >> 12) & 0x3F));
+    dest[2] = static_cast<char>(0x80 | ((codePoint >> 6) & 0x3F));
+    dest[3] = static_cast<char>(0x80 | (codePoint & 0x3F));
+    return 4;
+}
+
+
+//------------------------------------------------------------------------------
+// Value of an hex digit char, or -1 if ch is not an hex digit
+//------------------------------------------------------------------------------
+inline [[nodiscard]] int HexDigitValue(char ch) noexcept
+{
+    if (ch >= '0' && ch <= '9')
+    {
+        return ch - '0';
+    }
+    if (ch >= 'a' && ch <= 'f')
+    {
+        return ch - 'a' + 10;
+    }
+    if (ch >= 'A' && ch <= 'F')
+    {
+        return ch - 'A' + 10;
+    }
+    return -1;
+}
+
+
+//------------------------------------------------------------------------------
+// Make sure that str has room for at least required more code units
+// past the first used ones, growing it geometrically.
+//------------------------------------------------------------------------------
+template <typename StringType>
+inline void EnsureRoom(StringType& str, size_t used, size_t required)
+{
+    if (str.size() - used < required)
+    {
+        str.resize((std::max)(str.size() * 2, used + required));
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// Instruction set extensions beyond SSE2, detected at run time with CPUID
+//------------------------------------------------------------------------------
+struct CpuFeatures
+{
+    bool hasSsse3 = false;   // used by the 3-byte UTF-8 (e.g. CJK) kernels
+    bool hasSse42 = false;   // used by the CRC-32C hash
+};
+
+inline [[nodiscard]] const CpuFeatures& GetCpuFeatures() noexcept
+{
+    static const CpuFeatures features = []() noexcept
+    {
+        CpuFeatures result;
+#ifdef UNICODECONVSTD_SSE2
+        int cpuInfo[4] = {};
+        __cpuid(cpuInfo, 1);
+        result.hasSsse3 = (cpuInfo[2] & (1 << 9)) != 0;    // ECX bit 9
+        result.hasSse42 = (cpuInfo[2] & (1 << 20)) != 0;   // ECX bit 20
+#endif
+        return result;
+    }();
+    return features;
+}
+
+
+//------------------------------------------------------------------------------
+// Index of the lowest set bit in a non-zero mask
+//------------------------------------------------------------------------------
+inline [[nodiscard]] size_t LowestSetBit(unsigned int mask) noexcept
+{
+    _ASSERTE(mask != 0);
+
+#ifdef UNICODECONVSTD_SSE2
+    unsigned long index = 0;
+    _BitScanForward(&index, mask);
+    return index;
+#else
+    size_t index = 0;
+    while ((mask & 1) == 0)
+    {
+        mask >>= 1;
+        ++index;
+    }
+    return index;
+#endif
+}
+
+
+//------------------------------------------------------------------------------
+// Index of the highest set bit in a non-zero mask
+//------------------------------------------------------------------------------
+inline [[nodiscard]] size_t HighestSetBit(unsigned int mask) noexcept
+{
+    _ASSERTE(mask != 0);
+
+#ifdef UNICODECONVSTD_SSE2
+    unsigned long index = 0;
+    _BitScanReverse(&index, mask);
+    return index;
+#else
+    size_t index = 0;
+    while (mask >>= 1)
+    {
+        ++index;
+    }
+    return index;
+#endif
+}
+
+
+//------------------------------------------------------------------------------
+// Character classifiers for the clean run copy functions below.
+//
+// A "clean" code unit is an ASCII character that can be copied as is.
+// Non-ASCII code units always end a clean run; each classifier adds the
+// ASCII characters that need special processing (e.g. JSON backslashes).
+// SpecialMask() is the SSE2 version of IsSpecial(), working on 16 bytes.
+//------------------------------------------------------------------------------
+#ifdef UNICODECONVSTD_SSE2
+// 0xFF for each byte in the [low, high] ASCII range
+inline __m128i BytesInRange(__m128i bytes, char low, char high) noexcept
+{
+    return _mm_and_si128(
+        _mm_cmpgt_epi8(bytes, _mm_set1_epi8(static_cast<char>(low - 1))),
+        _mm_cmplt_epi8(bytes, _mm_set1_epi8(static_cast<char>(high + 1))));
+}
+#endif
+
+struct PlainAscii
+{
+    static bool IsSpecial(unsigned int /* ch */) noexcept
+    {
+        return false;
+    }
+
+#ifdef UNICODECONVSTD_SSE2
+    static __m128i SpecialMask(__m128i /* bytes */) noexcept
+    {
+        return _mm_setzero_si128();
+    }
+#endif
+};
+
+struct JsonEscapeStart
+{
+    static bool IsSpecial(unsigned int ch) noexcept
+    {
+        return ch == '\\';
+    }
+
+#ifdef UNICODECONVSTD_SSE2
+    static __m128i SpecialMask(__m128i bytes) noexcept
+    {
+        return _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\\'));
+    }
+#endif
+};
+
+
+// RFC 3986 unreserved chars are kept as is; everything else is percent-encoded
+struct PercentEncodeComponent
+{
+    static bool IsSpecial(unsigned int ch) noexcept
+    {
+        return !((ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || (ch >= '0' && ch <= '9')
+            || ch == '-' || ch == '.' || ch == '_' || ch == '~');
+    }
+
+#ifdef UNICODECONVSTD_SSE2
+    static __m128i SpecialMask(__m128i bytes) noexcept
+    {
+        const __m128i unreserved = _mm_or_si128(
+            _mm_or_si128(BytesInRange(bytes, 'a', 'z'), BytesInRange(bytes, 'A', 'Z')),
+            _mm_or_si128(
+                _mm_or_si128(BytesInRange(bytes, '0', '9'), BytesInRange(bytes, '-', '.')),
+                _mm_or_si128(
+                    _mm_cmpeq_epi8(bytes, _mm_set1_epi8('_')),
+                    _mm_cmpeq_epi8(bytes, _mm_set1_epi8('~')))));
+        return _mm_xor_si128(unreserved, _mm_set1_epi8(-1));
+    }
+#endif
+};
+
+// Path segments also keep sub-delims, ':', '@' and the '/' separator.
+// In ASCII order, the kept chars are: ! $ &'()*+,-./0-9:; = @A-Z _ a-z ~
+struct PercentEncodePath
+{
+    static bool IsSpecial(unsigned int ch) noexcept
+    {
+        return !((ch >= 'a' && ch <= 'z') || (ch >= '@' && ch <= 'Z') || (ch >= '&' && ch <= ';')
+            || ch == '!' || ch == '$' || ch == '=' || ch == '_' || ch == '~');
+    }
+
+#ifdef UNICODECONVSTD_SSE2
+    static __m128i SpecialMask(__m128i bytes) noexcept
+    {
+        const __m128i kept = _mm_or_si128(
+            _mm_or_si128(BytesInRange(bytes, 'a', 'z'), BytesInRange(bytes, '@', 'Z')),
+            _mm_or_si128(
+                _mm_or_si128(BytesInRange(bytes, '&', ';'), _mm_cmpeq_epi8(bytes, _mm_set1_epi8('!'))),
+                _mm_or_si128(
+                    _mm_or_si128(
+                        _mm_cmpeq_epi8(bytes, _mm_set1_epi8('$')),
+                        _mm_cmpeq_epi8(bytes, _mm_set1_epi8('='))),
+                    _mm_or_si128(
+                        _mm_cmpeq_epi8(bytes, _mm_set1_epi8('_')),
+                        _mm_cmpeq_epi8(bytes, _mm_set1_epi8('~'))))));
+        return _mm_xor_si128(kept, _mm_set1_epi8(-1));
+    }
+#endif
+};
+
+// The chars replaced by entities in HTML and XML text and attribute values
+struct HtmlSpecialChars
+{
+    static bool IsSpecial(unsigned int ch) noexcept
+    {
+        return ch == '&' || ch == '<' || ch == '>' || ch == '"' || ch == '\'';
+    }
+
+#ifdef UNICODECONVSTD_SSE2
+    static __m128i SpecialMask(__m128i bytes) noexcept
+    {
+        // '"', '&' and '\'' are 0x22, 0x26 and 0x27; '<' and '>' are 0x3C and 0x3E
+        return _mm_or_si128(
+            _mm_or_si128(
+                _mm_cmpeq_epi8(bytes, _mm_set1_epi8('"')),
+                BytesInRange(bytes, '&', '\'')),
+            _mm_or_si128(
+                _mm_cmpeq_epi8(bytes, _mm_set1_epi8('<')),
+                _mm_cmpeq_epi8(bytes, _mm_set1_epi8('>'))));
+    }
+#endif
+};
+
+struct PercentSign
+{
+    static bool IsSpecial(unsigned int ch) noexcept
+    {
+        return ch == '%';
+    }
+
+#ifdef UNICODECONVSTD_SSE2
+    static __m128i SpecialMask(__m128i bytes) noexcept
+    {
+        return _mm_cmpeq_epi8(bytes, _mm_set1_epi8('%'));
+    }
+#endif
+};
+
+struct LineFeed
+{
+    static bool IsSpecial(unsigned int ch) noexcept
+    {
+        return ch == '\n';
+    }
+
+#ifdef UNICODECONVSTD_SSE2
+    static __m128i SpecialMask(__m128i bytes) noexcept
+    {
+        return _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\n'));
+    }
+#endif
+};
+
+
+//------------------------------------------------------------------------------
+// Copy the run of clean (per Classifier) ASCII chars at the beginning of the
+// UTF-8 source to the UTF-16 destination, widening them.
+// Returns the length of the copied run; dest must have room for length units.
+//------------------------------------------------------------------------------
+template <typename Classifier>
+inline size_t CopyCleanRun(const char* src, size_t length, wchar_t* dest) noexcept
+{
+    size_t i = 0;
+
+#ifdef UNICODECONVSTD_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    while (length - i >= 16)
+    {
+        const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+
+        // Non-ASCII bytes have the sign bit set
+        const __m128i special = _mm_or_si128(
+            _mm_cmplt_epi8(bytes, zero), Classifier::SpecialMask(bytes));
+        const unsigned int mask = static_cast<unsigned int>(_mm_movemask_epi8(special));
+        if (mask != 0)
+        {
+            const size_t runEnd = i + LowestSetBit(mask);
+            for (; i < runEnd; ++i)
+            {
+                dest[i] = static_cast<wchar_t>(src[i]);
+            }
+            return i;
+        }
+
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + i), _mm_unpacklo_epi8(bytes, zero));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + i + 8), _mm_unpackhi_epi8(bytes, zero));
+        i += 16;
+    }
+#endif
+
+    for (; i < length; ++i)
+    {
+        const unsigned int ch = static_cast<unsigned char>(src[i]);
+        if (ch >= 0x80 || Classifier::IsSpecial(ch))
+        {
+            break;
+        }
+        dest[i] = static_cast<wchar_t>(ch);
+    }
+    return i;
+}
+
+
+#ifdef UNICODECONVSTD_SSE2
+//------------------------------------------------------------------------------
+// Load 16 UTF-16 code units, and narrow them to bytes.
+// Returns a mask with a bit set for each non-ASCII code unit
+// (the corresponding narrowed bytes are garbage).
+//------------------------------------------------------------------------------
+inline unsigned int NarrowUnits16(const wchar_t* src, __m128i& bytes) noexcept
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i nonAsciiBits = _mm_set1_epi16(static_cast<short>(0xFF80));
+    const __m128i lowByte = _mm_set1_epi16(0x00FF);
+
+    const __m128i units0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+    const __m128i units1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 8));
+
+    // 0xFF bytes for ASCII units
+    const __m128i ascii = _mm_packs_epi16(
+        _mm_cmpeq_epi16(_mm_and_si128(units0, nonAsciiBits), zero),
+        _mm_cmpeq_epi16(_mm_and_si128(units1, nonAsciiBits), zero));
+
+    bytes = _mm_packus_epi16(_mm_and_si128(units0, lowByte), _mm_and_si128(units1, lowByte));
+    return static_cast<unsigned int>(_mm_movemask_epi8(ascii)) ^ 0xFFFF;
+}
+#endif
+
+
+//------------------------------------------------------------------------------
+// Copy the run of clean (per Classifier) ASCII chars at the beginning of the
+// UTF-16 source to the UTF-8 destination, narrowing them.
+// Returns the length of the copied run; dest must have room for length chars.
+//------------------------------------------------------------------------------
+template <typename Classifier>
+inline size_t CopyCleanRun(const wchar_t* src, size_t length, char* dest) noexcept
+{
+    size_t i = 0;
+
+#ifdef UNICODECONVSTD_SSE2
+    while (length - i >= 16)
+    {
+        __m128i bytes;
+        const unsigned int nonAsciiMask = NarrowUnits16(src + i, bytes);
+        const unsigned int mask = nonAsciiMask
+            | static_cast<unsigned int>(_mm_movemask_epi8(Classifier::SpecialMask(bytes)));
+        if (mask != 0)
+        {
+            const size_t runEnd = i + LowestSetBit(mask);
+            for (; i < runEnd; ++i)
+            {
+                dest[i] = static_cast<char>(src[i]);
+            }
+            return i;
+        }
+
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + i), bytes);
+        i += 16;
+    }
+#endif
+
+    for (; i < length; ++i)
+    {
+        const unsigned int ch = src[i];
+        if (ch >= 0x80 || Classifier::IsSpecial(ch))
+        {
+            break;
+        }
+        dest[i] = static_cast<char>(ch);
+    }
+    return i;
+}
+
+
+
+//------------------------------------------------------------------------------
+// Length of the run of ASCII code units at the beginning of the given text,
+// scanned 16 code units at a time
+//------------------------------------------------------------------------------
+inline [[nodiscard]] size_t AsciiRunLength(const char* src, size_t length) noexcept
+{
+    size_t i = 0;
+
+#ifdef UNICODECONVSTD_SSE2
+    for (; length - i >= 16; i += 16)
+    {
+        const unsigned int mask = static_cast<unsigned int>(
+            _mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i))));
+        if (mask != 0)
+        {
+            return i + LowestSetBit(mask);
+        }
+    }
+#endif
+
+    while (i < length && static_cast<unsigned char>(src[i]) < 0x80)
+    {
+        ++i;
+    }
+    return i;
+}
+
+inline [[nodiscard]] size_t AsciiRunLength(const wchar_t* src, size_t length) noexcept
+{
+    size_t i = 0;
+
+#ifdef UNICODECONVSTD_SSE2
+    for (; length - i >= 16; i += 16)
+    {
+        __m128i bytes;
+        const unsigned int nonAsciiMask = NarrowUnits16(src + i, bytes);
+        if (nonAsciiMask != 0)
+        {
+            return i + LowestSetBit(nonAsciiMask);
+        }
+    }
+#endif
+
+    while (i < length && src[i] < 0x80)
+    {
+        ++i;
+    }
+    return i;
+}
+
+//------------------------------------------------------------------------------
+// Convert from UTF-16 to UTF-8, escaping the code points that are special
+// per Classifier, or non-ASCII, by calling escape(codePoint, dest).
+// escape() returns the number of chars it wrote, at most maxEscapeLength.
+// Clean runs are copied in bulk between the escaped code points.
+//------------------------------------------------------------------------------
+template <typename Classifier, typename EscapeFunction>
+inline [[nodiscard]] std::string EscapeToUtf8(
+    std::wstring_view utf16,
+    size_t maxEscapeLength,
+    EscapeFunction escape)
+{
+    // Start from a reasonable guess for the output length, and grow as needed
+    std::string utf8(utf16.length() + utf16.length() / 2 + 16, ' ');
+    size_t utf8Length = 0;
+
+    const wchar_t* src = utf16.data();
+    const wchar_t* const end = src + utf16.length();
+
+    while (src != end)
+    {
+        // Room for the clean run, plus the largest escape
+        const size_t remaining = static_cast<size_t>(end - src);
+        EnsureRoom(utf8, utf8Length, remaining + maxEscapeLength);
+
+        const size_t runLength = CopyCleanRun<Classifier>(src, remaining, utf8.data() + utf8Length);
+        src += runLength;
+        utf8Length += runLength;
+        if (src == end)
+        {
+            break;
+        }
+
+        char32_t codePoint;
+        const size_t unitCount = DecodeUtf16(src, end, codePoint);
+        if (unitCount == 0)
+        {
+            ThrowConversionError(ERROR_NO_UNICODE_TRANSLATION,
+                UnicodeConversionException::ConversionType::FromUtf16ToUtf8,
+                "Invalid UTF-16 sequence (unpaired surrogate).");
+        }
+        src += unitCount;
+        utf8Length += escape(codePoint, utf8.data() + utf8Length);
+    }
+
+    utf8.resize(utf8Length);
+    return utf8;
+}
+
+} // namespace Details
+
+
+//==============================================================================
+//                          JSON string unescaping
+//==============================================================================
+
+namespace Details
+{
+
+//------------------------------------------------------------------------------
+// Parse the four hex digits of a JSON \uXXXX escape.
+// Returns -1 if p doesn't point to four hex digits.
+//------------------------------------------------------------------------------
+inline [[nodiscard]] long ParseHex4(const char* p) noexcept
+{
+    long value = 0;
+    for (int i = 0; i < 4; ++i)
+    {
+        const int digit = HexDigitValue(p[i]);
+        if (digit < 0)
+        {
+            return -1;
+        }
+        value = (value << 4) | digit;
+    }
+    return value;
+}
+
+
+//------------------------------------------------------------------------------
+// Decode the JSON escape sequence starting at the backslash pointed by p,
+// writing the resulting UTF-16 code unit(s) to dest.
+// Escaped surrogate pairs (two consecutive \uXXXX escapes) are decoded as a whole.
+// Returns the number of source chars consumed; adds the number of
+// wchar_ts written to destLength. Throws on malformed escapes.
+//------------------------------------------------------------------------------
+inline size_t DecodeJsonEscape(const char* p, const char* end, wchar_t* dest, size_t& destLength)
+{
+    constexpr auto kConversionType = UnicodeConversionException::ConversionType::FromUtf8ToUtf16;
+
+    _ASSERTE(*p == '\\');
+    if (end - p < 2)
+    {
+        ThrowConversionError(ERROR_INVALID_DATA, kConversionType,
+            "Truncated JSON escape sequence at the end of the input string.");
+    }
+
+    wchar_t unescaped;
+    switch (p[1])
+    {
+    case '"':  unescaped = L'"';  break;
+    case '\\': unescaped = L'\\'; break;
+    case '/':  unescaped = L'/';  break;
+    case 'b':  unescaped = L'\b'; break;
+    case 'f':  unescaped = L'\f'; break;
+    case 'n':  unescaped = L'\n'; break;
+    case 'r':  unescaped = L'\r'; break;
+    case 't':  unescaped = L'\t'; break;
+
+    case 'u':
+    {
+        const long unit = (end - p >= 6) ? ParseHex4(p + 2) : -1;
+        if (unit < 0)
+        {
+            ThrowConversionError(ERROR_INVALID_DATA, kConversionType,
+                "Invalid JSON \\uXXXX escape sequence.");
+        }
+
+        if (unit >= 0xD800 && unit <= 0xDBFF)
+        {
+            // A high surrogate must be immediately followed by an escaped low surrogate
+            const long lowUnit = (end - p >= 12 && p[6] == '\\' && p[7] == 'u')
+                ? ParseHex4(p + 8) : -1;
+            if (lowUnit < 0xDC00 || lowUnit > 0xDFFF)
+            {
+                ThrowConversionError(ERROR_NO_UNICODE_TRANSLATION, kConversionType,
+                    "Unpaired high surrogate in JSON \\uXXXX escape sequence.");
+            }
+
+            dest[destLength++] = static_cast<wchar_t>(unit);
+            dest[destLength++] = static_cast<wchar_t>(lowUnit);
+            return 12;
+        }
+
+        if (unit >= 0xDC00 && unit <= 0xDFFF)
+        {
+            ThrowConversionError(ERROR_NO_UNICODE_TRANSLATION, kConversionType,
+                "Unpaired low surrogate in JSON \\uXXXX escape sequence.");
+        }
+
+        dest[destLength++] = static_cast<wchar_t>(unit);
+        return 6;
+    }
+
+    default:
+        ThrowConversionError(ERROR_INVALID_DATA, kConversionType,
+            "Invalid JSON escape sequence.");
+    }
+
+    dest[destLength++] = unescaped;
+    return 2;
+}
+
+} // namespace Details
+
+
+//------------------------------------------------------------------------------
+// Decode the escape sequences in the UTF-8 contents of a JSON string
+// (without the enclosing quotes), and convert the result to UTF-16,
+// in a single pass.
+// Runs of plain ASCII text are scanned and widened 16 chars at a time.
+// Signal invalid escapes and invalid UTF-8 sequences or unpaired escaped
+// surrogates throwing UnicodeConversionException.
+//------------------------------------------------------------------------------
+inline [[nodiscard]] std::wstring JsonUnescapeToUtf16(std::string_view utf8Json)
+{
+    constexpr auto kConversionType = UnicodeConversionException::ConversionType::FromUtf8ToUtf16;
+
+    // Special case of empty input string
+    if (utf8Json.empty())
+    {
+        return std::wstring{};
+    }
+
+    // Each input char produces at most one UTF-16 code unit,
+    // so the input length is an upper bound for the output length
+    std::wstring utf16(utf8Json.length(), L' ');
+    wchar_t* utf16Buffer = utf16.data();
+    _ASSERTE(utf16Buffer != nullptr);
+
+    const char* src = utf8Json.data();
+    const char* const end = src + utf8Json.length();
+    size_t utf16Length = 0;
+
+    while (src != end)
+    {
+        // Bulk copy the text up to the next escape or non-ASCII char
+        const size_t runLength = Details::CopyCleanRun<Details::JsonEscapeStart>(
+            src, static_cast<size_t>(end - src), utf16Buffer + utf16Length);
+        src += runLength;
+        utf16Length += runLength;
+        if (src == end)
+        {
+            break;
+        }
+
+        if (*src == '\\')
+        {
+            src += Details::DecodeJsonEscape(src, end, utf16Buffer, utf16Length);
+        }
+        else
+        {
+            char32_t codePoint;
+            const size_t sequenceLength = Details::DecodeUtf8(src, end, codePoint);
+            if (sequenceLength == 0)
+            {
+                Details::ThrowConversionError(ERROR_NO_UNICODE_TRANSLATION, kConversionType,
+                    "Invalid UTF-8 sequence in JSON string.");
+            }
+            src += sequenceLength;
+            utf16Length += Details::EncodeUtf16(codePoint, utf16Buffer + utf16Length);
+        }
+    }
+
+    utf16.resize(utf16Length);
+    return utf16;
+}
+
+
+//==============================================================================
+//                          URL percent-encoding
+//==============================================================================
+
+//------------------------------------------------------------------------------
+// The set of chars left as is by ToUtf8PercentEncoded
+//------------------------------------------------------------------------------
+enum class PercentEncodingCharset
+{
+    // Only RFC 3986 unreserved chars (A-Z a-z 0-9 - . _ ~) are left as is:
+    // suitable for query parameter names and values
+    Component,
+
+    // Also leave the path separator '/', and the other chars allowed
+    // in path segments: ! $ & ' ( ) * + , ; = : @
+    Path
+};
+
+
+namespace Details
+{
+
+//------------------------------------------------------------------------------
+// Percent-encode the UTF-8 encoding of the given code point (or ASCII char)
+// into dest. Returns the number of chars written (3 to 12).
+//------------------------------------------------------------------------------
+inline size_t PercentEncodeCodePoint(char32_t codePoint, char* dest) noexcept
+{
+    static constexpr char kHexDigits[] = "0123456789ABCDEF";
+
+    char utf8[4];
+    const size_t utf8Length = EncodeUtf8(codePoint, utf8);
+    for (size_t i = 0; i < utf8Length; ++i)
+    {
+        const unsigned int byte = static_cast<unsigned char>(utf8[i]);
+        dest[3 * i] = '%';
+        dest[3 * i + 1] = kHexDigits[byte >> 4];
+        dest[3 * i + 2] = kHexDigits[byte & 0x0F];
+    }
+    return 3 * utf8Length;
+}
+
+
+//------------------------------------------------------------------------------
+// Read the next byte of a percent-encoded string, decoding %XX escapes.
+// Advances p past the consumed chars; throws on malformed escapes.
+//------------------------------------------------------------------------------
+inline [[nodiscard]] unsigned int ReadPercentDecodedByte(const char*& p, const char* end)
+{
+    if (*p != '%')
+    {
+        return static_cast<unsigned char>(*p++);
+    }
+
+    const int high = (end - p >= 3) ? HexDigitValue(p[1]) : -1;
+    const int low = (high >= 0) ? HexDigitValue(p[2]) : -1;
+    if (low < 0)
+    {
+        ThrowConversionError(ERROR_INVALID_DATA,
+            UnicodeConversionException::ConversionType::FromUtf8ToUtf16,
+            "Invalid %XX escape sequence in percent-encoded string.");
+    }
+
+    p += 3;
+    return static_cast<unsigned int>((high << 4) | low);
+}
+
+} // namespace Details
+
+
+//------------------------------------------------------------------------------
+// Convert from UTF-16 to UTF-8, percent-encoding (RFC 3986) the chars that
+// are not in the given charset, in a single pass.
+// Runs of chars in the charset are classified and copied 16 at a time.
+// Signal errors throwing UnicodeConversionException.
+//------------------------------------------------------------------------------
+inline [[nodiscard]] std::string ToUtf8PercentEncoded(
+    std::wstring_view utf16,
+    PercentEncodingCharset charset = PercentEncodingCharset::Component)
+{
+    // Special case of empty input string
+    if (utf16.empty())
+    {
+        return std::string{};
+    }
+
+    // Each UTF-16 code unit can expand to up to 9 chars (%XX%XX%XX),
+    // a surrogate pair to 12 chars
+    constexpr size_t kMaxEscapeLength = 12;
+
+    if (charset == PercentEncodingCharset::Path)
+    {
+        return Details::EscapeToUtf8<Details::PercentEncodePath>(
+            utf16, kMaxEscapeLength, Details::PercentEncodeCodePoint);
+    }
+    return Details::EscapeToUtf8<Details::PercentEncodeComponent>(
+        utf16, kMaxEscapeLength, Details::PercentEncodeCodePoint);
+}
+
+
+//------------------------------------------------------------------------------
+// Decode the %XX escapes of a percent-encoded UTF-8 string, and convert
+// the result to UTF-16, in a single pass.
+// Multi-byte UTF-8 sequences can be escaped, raw, or a mix of both.
+// Note that '+' is not decoded as space (that's form encoding, not RFC 3986).
+// Signal malformed escapes and invalid UTF-8 throwing UnicodeConversionException.
+//------------------------------------------------------------------------------
+inline [[nodiscard]] std::wstring ToUtf16PercentDecoded(std::string_view percentEncoded)
+{
+    // Special case of empty input string
+    if (percentEncoded.empty())
+    {
+        return std::wstring{};
+    }
+
+    // Each input char produces at most one UTF-16 code unit
+    std::wstring utf16(percentEncoded.length(), L' ');
+    wchar_t* utf16Buffer = utf16.data();
+    _ASSERTE(utf16Buffer != nullptr);
+
+    const char* src = percentEncoded.data();
+    const char* const end = src + percentEncoded.length();
+    size_t utf16Length = 0;
+
+    while (src != end)
+    {
+        // Bulk copy the text up to the next escape or non-ASCII char
+        const size_t runLength = Details::CopyCleanRun<Details::PercentSign>(
+            src, static_cast<size_t>(end - src), utf16Buffer + utf16Length);
+        src += runLength;
+        utf16Length += runLength;
+        if (src == end)
+        {
+            break;
+        }
+
+        // Gather the (possibly escaped) bytes of the UTF-8 sequence
+        char sequence[4];
+        sequence[0] = static_cast<char>(Details::ReadPercentDecodedByte(src, end));
+        const unsigned int lead = static_cast<unsigned char>(sequence[0]);
+        const size_t expectedLength = (lead < 0x80) ? 1 : (lead < 0xE0) ? 2 : (lead < 0xF0) ? 3 : 4;
+        size_t sequenceLength = 1;
+        while (sequenceLength < expectedLength && src != end)
+        {
+            sequence[sequenceLength++] = static_cast<char>(Details::ReadPercentDecodedByte(src, end));
+        }
+
+        char32_t codePoint;
+        if (Details::DecodeUtf8(sequence, sequence + sequenceLength, codePoint) != sequenceLength)
+        {
+            Details::ThrowConversionError(ERROR_NO_UNICODE_TRANSLATION,
+                UnicodeConversionException::ConversionType::FromUtf8ToUtf16,
+                "Invalid UTF-8 sequence in percent-encoded string.");
+        }
+        utf16Length += Details::EncodeUtf16(codePoint, utf16Buffer + utf16Length);
+    }
+
+    utf16.resize(utf16Length);
+    return utf16;
+}
+
+
+//==============================================================================
+//                          HTML/XML entity escaping
+//==============================================================================
+
+namespace Details
+{
+
+//------------------------------------------------------------------------------
+// Write the entity for an HTML special char, or the UTF-8 encoding
+// of a non-ASCII code point, to dest. Returns the number of chars written.
+//------------------------------------------------------------------------------
+inline size_t HtmlEscapeCodePoint(char32_t codePoint, char* dest) noexcept
+{
+    std::string_view entity;
+    switch (codePoint)
+    {
+    case '&':  entity = "&amp;";  break;
+    case '<':  entity = "&lt;";   break;
+    case '>':  entity = "&gt;";   break;
+    case '"':  entity = "&quot;"; break;
+    case '\'': entity = "&#39;";  break;
+
+    default:
+        return EncodeUtf8(codePoint, dest);
+    }
+
+    entity.copy(dest, entity.length());
+    return entity.length();
+}
+
+} // namespace Details
+
+
+//------------------------------------------------------------------------------
+// Convert from UTF-16 to UTF-8, replacing the chars & < > " ' with the
+// corresponding entities (&amp; &lt; &gt; &quot; &#39;), in a single pass.
+// The result is safe for HTML and XML text content and attribute values.
+// Runs of text without special chars are detected and copied 16 at a time.
+// Signal errors throwing UnicodeConversionException.
+//------------------------------------------------------------------------------
+inline [[nodiscard]] std::string ToUtf8HtmlEscaped(std::wstring_view utf16)
+{
+    // Special case of empty input string
+    if (utf16.empty())
+    {
+        return std::string{};
+    }
+
+    // "&quot;" is the longest replacement
+    constexpr size_t kMaxEscapeLength = 6;
+
+    return Details::EscapeToUtf8<Details::HtmlSpecialChars>(
+        utf16, kMaxEscapeLength, Details::HtmlEscapeCodePoint);
+}
+
+
+//==============================================================================
+//                  Portable UTF-16/UTF-8 transcoding engine
+//==============================================================================
+
+//------------------------------------------------------------------------------
+// Conversion kernels of the portable engine. The fused conversions and sinks
+// pick one for each conversion, sampling the beginning of the text:
+//
+//  Ascii:          bulk copies of ASCII runs; mostly ASCII text
+//  Generic:        code point by code point; e.g. Latin, Cyrillic, Greek text
+//  ThreeByte:      fixed-stride SIMD for 3-char UTF-8 code points; e.g. CJK text
+//  Supplementary:  SIMD for surrogate pairs and 4-char UTF-8; e.g. emoji
+//------------------------------------------------------------------------------
+enum class ConversionKernel
+{
+    Ascii,
+    Generic,
+    ThreeByte,
+    Supplementary
+};
+
+inline constexpr size_t kConversionKernelCount = 4;
+
+
+namespace Details
+{
+
+//------------------------------------------------------------------------------
+// Length in chars of the UTF-8 encoding of the given UTF-16 text.
+// The result is exact for valid UTF-16; invalid input is detected
+// later by the conversion functions.
+//------------------------------------------------------------------------------
+inline [[nodiscard]] size_t Utf8LengthOfUtf16(const wchar_t* src, size_t length) noexcept
+{
+    // Each code unit takes one char, plus one if it's >= U+0080, plus one
+    // if it's >= U+0800; surrogates take 2 chars each (4 per pair)
+    size_t utf8Length = length;
+    size_t i = 0;
+
+#ifdef UNICODECONVSTD_SSE2
+    // SSE2 has only signed 16-bit compares: flip the sign bits
+    // to compare code units as unsigned values
+    const __m128i signBit = _mm_set1_epi16(static_cast<short>(0x8000));
+    const __m128i above7F = _mm_set1_epi16(static_cast<short>(0x007F ^ 0x8000));
+    const __m128i above7FF = _mm_set1_epi16(static_cast<short>(0x07FF ^ 0x8000));
+    const __m128i surrogateBits = _mm_set1_epi16(static_cast<short>(0xF800));
+    const __m128i surrogate = _mm_set1_epi16(static_cast<short>(0xD800));
+    const __m128i ones = _mm_set1_epi16(1);
+
+    while (length - i >= 8)
+    {
+        // Each 16-bit counter changes by at most 2 per iteration:
+        // flush them well before they can overflow
+        const size_t blockEnd = i + (std::min)((length - i) & ~size_t{7}, size_t{8 * 8192});
+        __m128i counters = _mm_setzero_si128();
+        for (; i < blockEnd; i += 8)
+        {
+            const __m128i units = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+            const __m128i biased = _mm_xor_si128(units, signBit);
+
+            // Compare results are -1 for true
+            counters = _mm_sub_epi16(counters, _mm_cmpgt_epi16(biased, above7F));
+            counters = _mm_sub_epi16(counters, _mm_cmpgt_epi16(biased, above7FF));
+            counters = _mm_add_epi16(counters,
+                _mm_cmpeq_epi16(_mm_and_si128(units, surrogateBits), surrogate));
+        }
+
+        // Horizontal sum of the counters
+        alignas(16) int sums[4];
+        _mm_store_si128(reinterpret_cast<__m128i*>(sums), _mm_madd_epi16(counters, ones));
+        utf8Length += static_cast<size_t>(
+            static_cast<std::int64_t>(sums[0]) + sums[1] + sums[2] + sums[3]);
+    }
+#endif
+
+    for (; i < length; ++i)
+    {
+        const unsigned int unit = src[i];
+        if (unit >= 0x80)
+        {
+            utf8Length += ((unit & 0xF800) == 0xD800) ? 1 : (unit >= 0x800) ? 2 : 1;
+        }
+    }
+    return utf8Length;
+}
+
+
+//------------------------------------------------------------------------------
+// Length in wchar_ts of the UTF-16 encoding of the given UTF-8 text.
+// The result is exact for valid UTF-8; invalid input is detected
+// later by the conversion functions.
+//------------------------------------------------------------------------------
+inline [[nodiscard]] size_t Utf16LengthOfUtf8(const char* src, size_t length) noexcept
+{
+    // Each code point takes one code unit, plus one for the 4-char sequences:
+    // count the chars that are not continuation bytes, and the 4-char leads
+    size_t utf16Length = length;
+    size_t i = 0;
+
+#ifdef UNICODECONVSTD_SSE2
+    // As signed chars, continuation bytes (0x80-0xBF) are less than -64 (0xC0),
+    // and 4-char lead bytes (0xF0-0xFF) are negative and greater than -17 (0xEF)
+    const __m128i continuationLimit = _mm_set1_epi8(-64);
+    const __m128i leadLimit = _mm_set1_epi8(-17);
+    const __m128i zero = _mm_setzero_si128();
+
+    while (length - i >= 16)
+    {
+        // Each 8-bit counter changes by at most 1 per iteration
+        const size_t blockEnd = i + (std::min)((length - i) & ~size_t{15}, size_t{16 * 255});
+        __m128i continuations = zero;
+        __m128i leads = zero;
+        for (; i < blockEnd; i += 16)
+        {
+            const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+            continuations = _mm_sub_epi8(continuations, _mm_cmplt_epi8(bytes, continuationLimit));
+            leads = _mm_sub_epi8(leads,
+                _mm_and_si128(_mm_cmpgt_epi8(bytes, leadLimit), _mm_cmplt_epi8(bytes, zero)));
+        }
+
+        // Horizontal sums of the 8-bit counters
+        const __m128i continuationSums = _mm_sad_epu8(continuations, zero);
+        const __m128i leadSums = _mm_sad_epu8(leads, zero);
+        utf16Length -= static_cast<size_t>(_mm_cvtsi128_si32(continuationSums))
+            + static_cast<size_t>(_mm_cvtsi128_si32(_mm_srli_si128(continuationSums, 8)));
+        utf16Length += static_cast<size_t>(_mm_cvtsi128_si32(leadSums))
+            + static_cast<size_t>(_mm_cvtsi128_si32(_mm_srli_si128(leadSums, 8)));
+    }
+#endif
+
+    for (; i < length; ++i)
+    {
+        const unsigned int byte = static_cast<unsigned char>(src[i]);
+        if ((byte & 0xC0) == 0x80)
+        {
+            --utf16Length;
+        }
+        else if (byte >= 0xF0)
+        {
+            ++utf16Length;
+        }
+    }
+    return utf16Length;
+}
+
+
+#ifdef UNICODECONVSTD_SSE2
+//------------------------------------------------------------------------------
+// Convert the run of surrogate pairs at the beginning of the UTF-16 source
+// to 4-char UTF-8 sequences (emoji and other supplementary plane code points),
+// 4 pairs at a time: each pair is processed in a 32-bit lane.
+// Returns the number of code units consumed (a multiple of 8); the number
+// of chars written is twice that.
+//------------------------------------------------------------------------------
+inline size_t ConvertSurrogatePairsToUtf8(const wchar_t* src, size_t length, char* dest) noexcept
+{
+    // In each little-endian lane, the high surrogate is in the low 16 bits
+    const __m128i pairBits = _mm_set1_epi32(static_cast<int>(0xFC00FC00));
+    const __m128i pairValue = _mm_set1_epi32(static_cast<int>(0xDC00D800));
+    const __m128i tenBits = _mm_set1_epi32(0x3FF);
+    const __m128i sixBits = _mm_set1_epi32(0x3F);
+    const __m128i continuation = _mm_set1_epi32(0x80);
+
+    size_t i = 0;
+    for (; length - i >= 8; i += 8)
+    {
+        const __m128i pairs = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(pairs, pairBits), pairValue)) != 0xFFFF)
+        {
+            break;
+        }
+
+        const __m128i codePoints = _mm_add_epi32(
+            _mm_or_si128(
+                _mm_slli_epi32(_mm_and_si128(pairs, tenBits), 10),
+                _mm_and_si128(_mm_srli_epi32(pairs, 16), tenBits)),
+            _mm_set1_epi32(0x10000));
+
+        // 11110xxx 10xxxxxx 10xxxxxx 10xxxxxx, first byte in the low 8 bits
+        const __m128i byte0 = _mm_or_si128(_mm_srli_epi32(codePoints, 18), _mm_set1_epi32(0xF0));
+        const __m128i byte1 = _mm_or_si128(
+            _mm_and_si128(_mm_srli_epi32(codePoints, 12), sixBits), continuation);
+        const __m128i byte2 = _mm_or_si128(
+            _mm_and_si128(_mm_srli_epi32(codePoints, 6), sixBits), continuation);
+        const __m128i byte3 = _mm_or_si128(_mm_and_si128(codePoints, sixBits), continuation);
+
+        const __m128i utf8 = _mm_or_si128(
+            _mm_or_si128(byte0, _mm_slli_epi32(byte1, 8)),
+            _mm_or_si128(_mm_slli_epi32(byte2, 16), _mm_slli_epi32(byte3, 24)));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + 2 * i), utf8);
+    }
+    return i;
+}
+
+
+//------------------------------------------------------------------------------
+// Convert the run of 4-char UTF-8 sequences at the beginning of the source
+// to UTF-16 surrogate pairs, 4 sequences at a time, validating them.
+// Returns the number of chars consumed (a multiple of 16); the number
+// of wchar_ts written is half of that.
+//------------------------------------------------------------------------------
+inline size_t ConvertFourByteSequencesToUtf16(const char* src, size_t length, wchar_t* dest) noexcept
+{
+    const __m128i sequenceBits = _mm_set1_epi32(static_cast<int>(0xC0C0C0F8));
+    const __m128i sequenceValue = _mm_set1_epi32(static_cast<int>(0x808080F0));
+    const __m128i maxOffset = _mm_set1_epi32(0x10FFFF - 0x10000);
+    const __m128i tenBits = _mm_set1_epi32(0x3FF);
+
+    size_t i = 0;
+    for (; length - i >= 16; i += 16)
+    {
+        const __m128i sequences = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(sequences, sequenceBits), sequenceValue)) != 0xFFFF)
+        {
+            break;
+        }
+
+        // Gather the 3 + 6 + 6 + 6 payload bits of each sequence
+        const __m128i codePoints = _mm_or_si128(
+            _mm_or_si128(
+                _mm_slli_epi32(_mm_and_si128(sequences, _mm_set1_epi32(0x07)), 18),
+                _mm_slli_epi32(_mm_and_si128(sequences, _mm_set1_epi32(0x3F00)), 4)),
+            _mm_or_si128(
+                _mm_srli_epi32(_mm_and_si128(sequences, _mm_set1_epi32(0x3F0000)), 10),
+                _mm_and_si128(_mm_srli_epi32(sequences, 24), _mm_set1_epi32(0x3F))));
+
+        // Reject overlong sequences (below U+10000) and code points above U+10FFFF
+        const __m128i offsets = _mm_sub_epi32(codePoints, _mm_set1_epi32(0x10000));
+        const __m128i outOfRange = _mm_or_si128(
+            _mm_cmplt_epi32(offsets, _mm_setzero_si128()), _mm_cmpgt_epi32(offsets, maxOffset));
+        if (_mm_movemask_epi8(outOfRange) != 0)
+        {
+            break;
+        }
+
+        // High surrogate in the low 16 bits of each lane, low surrogate above it
+        const __m128i pairs = _mm_or_si128(
+            _mm_or_si128(_mm_srli_epi32(offsets, 10), _mm_set1_epi32(0xD800)),
+            _mm_slli_epi32(_mm_or_si128(_mm_and_si128(offsets, tenBits), _mm_set1_epi32(0xDC00)), 16));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + i / 2), pairs);
+    }
+    return i;
+}
+
+
+//------------------------------------------------------------------------------
+// Convert the run of code units in the U+0800 - U+FFFF range (excluding
+// surrogates) at the beginning of the UTF-16 source, which take 3 chars
+// each in UTF-8 (e.g. CJK text), 8 code units at a time: the 24 output
+// chars are placed at their fixed-stride positions with SSSE3 shuffles.
+// Returns the number of code units consumed (a multiple of 8); the number
+// of chars written is three times that.
+// Requires SSSE3 support (checked by the caller).
+//------------------------------------------------------------------------------
+inline size_t ConvertThreeByteUnitsToUtf8(const wchar_t* src, size_t length, char* dest) noexcept
+{
+    const __m128i signBit = _mm_set1_epi16(static_cast<short>(0x8000));
+    const __m128i below800 = _mm_set1_epi16(static_cast<short>(0x07FF ^ 0x8000));
+    const __m128i surrogateBits = _mm_set1_epi16(static_cast<short>(0xF800));
+    const __m128i surrogate = _mm_set1_epi16(static_cast<short>(0xD800));
+    const __m128i sixBits = _mm_set1_epi16(0x3F);
+    const __m128i continuation = _mm_set1_epi16(0x80);
+
+    // For output char 3k, 3k+1, 3k+2: lead and first continuation byte
+    // of unit k are in the 16-bit lane k of leads, the last one in lasts
+    const __m128i leadsToOutput0 = _mm_setr_epi8(0, 1, -1, 2, 3, -1, 4, 5, -1, 6, 7, -1, 8, 9, -1, 10);
+    const __m128i lastsToOutput0 = _mm_setr_epi8(-1, -1, 0, -1, -1, 2, -1, -1, 4, -1, -1, 6, -1, -1, 8, -1);
+    const __m128i leadsToOutput1 = _mm_setr_epi8(11, -1, 12, 13, -1, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i lastsToOutput1 = _mm_setr_epi8(-1, 10, -1, -1, 12, -1, -1, 14, -1, -1, -1, -1, -1, -1, -1, -1);
+
+    size_t i = 0;
+    for (; length - i >= 8; i += 8)
+    {
+        const __m128i units = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        const __m128i threeByte = _mm_andnot_si128(
+            _mm_cmpeq_epi16(_mm_and_si128(units, surrogateBits), surrogate),
+            _mm_cmpgt_epi16(_mm_xor_si128(units, signBit), below800));
+        if (_mm_movemask_epi8(threeByte) != 0xFFFF)
+        {
+            break;
+        }
+
+        // 1110xxxx 10xxxxxx in each 16-bit lane of leads, 10xxxxxx in lasts
+        const __m128i leads = _mm_or_si128(
+            _mm_or_si128(_mm_srli_epi16(units, 12), _mm_set1_epi16(0xE0)),
+            _mm_slli_epi16(_mm_or_si128(_mm_and_si128(_mm_srli_epi16(units, 6), sixBits), continuation), 8));
+        const __m128i lasts = _mm_or_si128(_mm_and_si128(units, sixBits), continuation);
+
+        const __m128i output0 = _mm_or_si128(
+            _mm_shuffle_epi8(leads, leadsToOutput0), _mm_shuffle_epi8(lasts, lastsToOutput0));
+        const __m128i output1 = _mm_or_si128(
+            _mm_shuffle_epi8(leads, leadsToOutput1), _mm_shuffle_epi8(lasts, lastsToOutput1));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + 3 * i), output0);
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(dest + 3 * i + 16), output1);
+    }
+    return i;
+}
+
+
+//------------------------------------------------------------------------------
+// Decode 4 3-char UTF-8 sequences (12 chars at src) into the 32-bit lanes
+// of codePoints. Returns false if any of them is not a valid 3-char sequence.
+// Requires SSSE3 support.
+//------------------------------------------------------------------------------
+inline bool DecodeFourThreeByteSequences(const char* src, __m128i& codePoints) noexcept
+{
+    // Lane k gets the sequence chars 3k+2, 3k+1, 3k in its low 3 bytes
+    const __m128i strideShuffle = _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1);
+    const __m128i sequences = _mm_shuffle_epi8(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(src)), strideShuffle);
+
+    const __m128i wellFormed = _mm_cmpeq_epi32(
+        _mm_and_si128(sequences, _mm_set1_epi32(0x00F0C0C0)), _mm_set1_epi32(0x00E08080));
+
+    codePoints = _mm_or_si128(
+        _mm_or_si128(
+            _mm_and_si128(_mm_srli_epi32(sequences, 4), _mm_set1_epi32(0xF000)),
+            _mm_and_si128(_mm_srli_epi32(sequences, 2), _mm_set1_epi32(0x0FC0))),
+        _mm_and_si128(sequences, _mm_set1_epi32(0x3F)));
+
+    // Reject overlong sequences (below U+0800) and surrogates
+    const __m128i valid = _mm_andnot_si128(
+        _mm_cmpeq_epi32(_mm_and_si128(codePoints, _mm_set1_epi32(0xF800)), _mm_set1_epi32(0xD800)),
+        _mm_and_si128(wellFormed, _mm_cmpgt_epi32(codePoints, _mm_set1_epi32(0x07FF))));
+    return _mm_movemask_epi8(valid) == 0xFFFF;
+}
+
+
+//------------------------------------------------------------------------------
+// Convert the run of 3-char UTF-8 sequences at the beginning of the source
+// (e.g. CJK text) to UTF-16, 8 sequences (24 chars) at a time, validating them.
+// Returns the number of chars consumed (a multiple of 24); the number of
+// wchar_ts written is a third of that.
+// Requires SSSE3 support (checked by the caller).
+//------------------------------------------------------------------------------
+inline size_t ConvertThreeByteSequencesToUtf16(const char* src, size_t length, wchar_t* dest) noexcept
+{
+    size_t i = 0;
+
+    // The second 16-char load starts at src + 12
+    for (; length - i >= 28; i += 24)
+    {
+        __m128i codePoints0;
+        __m128i codePoints1;
+        if (!DecodeFourThreeByteSequences(src + i, codePoints0)
+            || !DecodeFourThreeByteSequences(src + i + 12, codePoints1))
+        {
+            break;
+        }
+
+        // Sign-extend the 16-bit values, so that the signed saturating pack
+        // keeps them as they are
+        codePoints0 = _mm_srai_epi32(_mm_slli_epi32(codePoints0, 16), 16);
+        codePoints1 = _mm_srai_epi32(_mm_slli_epi32(codePoints1, 16), 16);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + i / 3), _mm_packs_epi32(codePoints0, codePoints1));
+    }
+    return i;
+}
+#endif
+
+
+//------------------------------------------------------------------------------
+// Number of code units sampled at the beginning of the text
+// to pick the conversion kernel
+//------------------------------------------------------------------------------
+inline constexpr size_t kKernelSampleLength = 64;
+
+
+//------------------------------------------------------------------------------
+// Pick the conversion kernel for a sample of the given number of code units,
+// given how many of them are ASCII, part of 3-char UTF-8 code points,
+// or part of supplementary plane code points
+//------------------------------------------------------------------------------
+inline [[nodiscard]] ConversionKernel SelectKernel(size_t sampleLength,
+    size_t asciiUnits, size_t threeByteUnits, size_t supplementaryUnits) noexcept
+{
+    // The SIMD kernels pay off when at least a quarter of the text is theirs
+    if (threeByteUnits * 4 >= sampleLength && threeByteUnits >= supplementaryUnits
+        && GetCpuFeatures().hasSsse3)
+    {
+        return ConversionKernel::ThreeByte;
+    }
+
+#ifdef UNICODECONVSTD_SSE2
+    if (supplementaryUnits * 4 >= sampleLength)
+    {
+        return ConversionKernel::Supplementary;
+    }
+#endif
+
+    // Bulk copies of ASCII runs pay off when they are long enough
+    return (asciiUnits * 2 >= sampleLength) ? ConversionKernel::Ascii : ConversionKernel::Generic;
+}
+
+
+//------------------------------------------------------------------------------
+// Pick the kernel to convert the given UTF-16 text (length > 0) to UTF-8,
+// sampling its beginning
+//------------------------------------------------------------------------------
+inline [[nodiscard]] ConversionKernel SelectUtf16ToUtf8Kernel(const wchar_t* src, size_t length) noexcept
+{
+    const size_t sampleLength = (std::min)(length, kKernelSampleLength);
+    size_t asciiUnits = 0;
+    size_t threeByteUnits = 0;
+    size_t supplementaryUnits = 0;
+    for (size_t i = 0; i < sampleLength; ++i)
+    {
+        const unsigned int unit = src[i];
+        if (unit < 0x80)
+        {
+            ++asciiUnits;
+        }
+        else if (unit >= 0xD800 && unit <= 0xDFFF)
+        {
+            ++supplementaryUnits;
+        }
+        else if (unit >= 0x800)
+        {
+            ++threeByteUnits;
+        }
+    }
+    return SelectKernel(sampleLength, asciiUnits, threeByteUnits, supplementaryUnits);
+}
+
+
+//------------------------------------------------------------------------------
+// Pick the kernel to convert the given UTF-8 text (length > 0) to UTF-16,
+// sampling its beginning
+//------------------------------------------------------------------------------
+inline [[nodiscard]] ConversionKernel SelectUtf8ToUtf16Kernel(const char* src, size_t length) noexcept
+{
+    const size_t sampleLength = (std::min)(length, kKernelSampleLength);
+    size_t asciiUnits = 0;
+    size_t threeByteUnits = 0;
+    size_t supplementaryUnits = 0;
+    for (size_t i = 0; i < sampleLength; ++i)
+    {
+        const unsigned int byte = static_cast<unsigned char>(src[i]);
+        if (byte < 0x80)
+        {
+            ++asciiUnits;
+        }
+        else if (byte >= 0xF0)
+        {
+            supplementaryUnits += 4;
+        }
+        else if (byte >= 0xE0)
+        {
+            threeByteUnits += 3;
+        }
+    }
+    return SelectKernel(sampleLength, asciiUnits, threeByteUnits, supplementaryUnits);
+}
+
+
+#ifdef UNICODECONVSTD_KERNEL_TELEMETRY
+//------------------------------------------------------------------------------
+// Counters of the kernels picked by the conversions, for telemetry.
+// They're shared by all the threads: every conversion writes to the same
+// cache line, so they're compiled in only on request.
+//------------------------------------------------------------------------------
+inline [[nodiscard]] std::array<std::atomic<std::uint64_t>, kConversionKernelCount>&
+    KernelSelectionCounters() noexcept
+{
+    static std::array<std::atomic<std::uint64_t>, kConversionKernelCount> counters{};
+    return counters;
+}
+#endif
+
+
+inline ConversionKernel RecordKernelSelection(ConversionKernel kernel) noexcept
+{
+#ifdef UNICODECONVSTD_KERNEL_TELEMETRY
+    KernelSelectionCounters()[static_cast<size_t>(kernel)].fetch_add(1, std::memory_order_relaxed);
+#endif
+    return kernel;
+}
+
+
+//------------------------------------------------------------------------------
+// Pick, and record, the kernel of a whole conversion of the given text.
+// The conversions done in blocks pick it once, and use it for every block.
+// There's nothing to pick for empty text.
+//------------------------------------------------------------------------------
+inline ConversionKernel PickUtf16ToUtf8Kernel(const wchar_t* src, size_t length) noexcept
+{
+    return (length == 0) ? ConversionKernel::Ascii
+        : RecordKernelSelection(SelectUtf16ToUtf8Kernel(src, length));
+}
+
+inline ConversionKernel PickUtf8ToUtf16Kernel(const char* src, size_t length) noexcept
+{
+    return (length == 0) ? ConversionKernel::Ascii
+        : RecordKernelSelection(SelectUtf8ToUtf16Kernel(src, length));
+}
+
+
+//------------------------------------------------------------------------------
+// Convert the non-ASCII code points at src to UTF-8 with the given kernel,
+// up to the next ASCII char or end, advancing src and dest.
+// Throws UnicodeConversionException on invalid UTF-16 (unpaired surrogates).
+//------------------------------------------------------------------------------
+template <ConversionKernel Kernel>
+inline void ConvertNonAsciiRunToUtf8(const wchar_t*& src, const wchar_t* end, char*& dest)
+{
+    while (src != end && *src >= 0x80)
+    {
+#ifdef UNICODECONVSTD_SSE2
+        if constexpr (Kernel == ConversionKernel::Supplementary)
+        {
+            // Runs of surrogate pairs (e.g. emoji) go through the SIMD kernel
+            if (*src >= 0xD800 && *src <= 0xDBFF)
+            {
+                const size_t pairUnits = ConvertSurrogatePairsToUtf8(
+                    src, static_cast<size_t>(end - src), dest);
+                src += pairUnits;
+                dest += 2 * pairUnits;
+                if (src == end || *src < 0x80)
+                {
+                    break;
+                }
+            }
+        }
+        else if constexpr (Kernel == ConversionKernel::ThreeByte)
+        {
+            // Runs of 3-char code points (e.g. CJK) go through the fixed-stride kernel
+            if (*src >= 0x800)
+            {
+                const size_t threeByteUnits = ConvertThreeByteUnitsToUtf8(
+                    src, static_cast<size_t>(end - src), dest);
+                src += threeByteUnits;
+                dest += 3 * threeByteUnits;
+                if (src == end || *src < 0x80)
+                {
+                    break;
+                }
+            }
+        }
+#endif
+
+        char32_t codePoint;
+        const size_t unitCount = DecodeUtf16(src, end, codePoint);
+        if (unitCount == 0)
+        {
+            ThrowConversionError(ERROR_NO_UNICODE_TRANSLATION,
+                UnicodeConversionException::ConversionType::FromUtf16ToUtf8,
+                "Invalid UTF-16 sequence (unpaired surrogate).");
+        }
+        src += unitCount;
+        dest += EncodeUtf8(codePoint, dest);
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// Convert length UTF-16 code units to UTF-8 with the given kernel, writing
+// to dest, which must have room for the whole result (at most 3 chars per
+// code unit). Every kernel converts any text; they differ in the fast paths
+// they try, that pay off only on text of the matching composition.
+// Returns the number of chars written.
+// Throws UnicodeConversionException on invalid UTF-16 (unpaired surrogates).
+//------------------------------------------------------------------------------
+template <ConversionKernel Kernel>
+inline size_t TranscodeUtf16ToUtf8With(const wchar_t* src, size_t length, char* dest)
+{
+    const wchar_t* const end = src + length;
+    char* const destBegin = dest;
+
+    while (src != end)
+    {
+        if constexpr (Kernel == ConversionKernel::Generic)
+        {
+            // ASCII runs between the non-ASCII code points are short:
+            // bulk copies wouldn't pay off
+            if (*src < 0x80)
+            {
+                *dest++ = static_cast<char>(*src++);
+                continue;
+            }
+        }
+        else
+        {
+            const size_t runLength = CopyCleanRun<PlainAscii>(src, static_cast<size_t>(end - src), dest);
+            src += runLength;
+            dest += runLength;
+        }
+
+        // Convert the non-ASCII code points up to the next ASCII char
+        ConvertNonAsciiRunToUtf8<Kernel>(src, end, dest);
+    }
+
+    return static_cast<size_t>(dest - destBegin);
+}
+
+
+//------------------------------------------------------------------------------
+// Dispatch to the TranscodeUtf16ToUtf8With() instance of the given kernel
+//------------------------------------------------------------------------------
+inline size_t TranscodeUtf16ToUtf8With(
+    ConversionKernel kernel, const wchar_t* src, size_t length, char* dest)
+{
+    switch (kernel)
+    {
+    case ConversionKernel::Generic:
+        return TranscodeUtf16ToUtf8With<ConversionKernel::Generic>(src, length, dest);
+
+    case ConversionKernel::ThreeByte:
+        return TranscodeUtf16ToUtf8With<ConversionKernel::ThreeByte>(src, length, dest);
+
+    case ConversionKernel::Supplementary:
+        return TranscodeUtf16ToUtf8With<ConversionKernel::Supplementary>(src, length, dest);
+
+    default:
+        return TranscodeUtf16ToUtf8With<ConversionKernel::Ascii>(src, length, dest);
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// Like TranscodeUtf16ToUtf8With(), also appending to lineOffsets the offset
+// after each LF, found by the same run scan that copies the ASCII chars.
+// destOffset is the offset of dest in the whole converted string.
+//------------------------------------------------------------------------------
+template <ConversionKernel Kernel>
+inline size_t TranscodeUtf16ToUtf8IndexingLines(const wchar_t* src, size_t length, char* dest,
+    size_t destOffset, std::vector<size_t>& lineOffsets)
+{
+    const wchar_t* const end = src + length;
+    char* const destBegin = dest;
+
+    while (src != end)
+    {
+        if constexpr (Kernel == ConversionKernel::Generic)
+        {
+            if (*src < 0x80)
+            {
+                const char ch = static_cast<char>(*src++);
+                *dest++ = ch;
+                if (ch == '\n')
+                {
+                    lineOffsets.push_back(destOffset + static_cast<size_t>(dest - destBegin));
+                }
+                continue;
+            }
+        }
+        else
+        {
+            const size_t runLength = CopyCleanRun<LineFeed>(src, static_cast<size_t>(end - src), dest);
+            src += runLength;
+            dest += runLength;
+            if (src != end && *src == L'\n')
+            {
+                ++src;
+                *dest++ = '\n';
+                lineOffsets.push_back(destOffset + static_cast<size_t>(dest - destBegin));
+                continue;
+            }
+        }
+
+        ConvertNonAsciiRunToUtf8<Kernel>(src, end, dest);
+    }
+
+    return static_cast<size_t>(dest - destBegin);
+}
+
+
+inline size_t TranscodeUtf16ToUtf8IndexingLines(ConversionKernel kernel, const wchar_t* src,
+    size_t length, char* dest, size_t destOffset, std::vector<size_t>& lineOffsets)
+{
+    switch (kernel)
+    {
+    case ConversionKernel::Generic:
+        return TranscodeUtf16ToUtf8IndexingLines<ConversionKernel::Generic>(
+            src, length, dest, destOffset, lineOffsets);
+
+    case ConversionKernel::ThreeByte:
+        return TranscodeUtf16ToUtf8IndexingLines<ConversionKernel::ThreeByte>(
+            src, length, dest, destOffset, lineOffsets);
+
+    case ConversionKernel::Supplementary:
+        return TranscodeUtf16ToUtf8IndexingLines<ConversionKernel::Supplementary>(
+            src, length, dest, destOffset, lineOffsets);
+
+    default:
+        return TranscodeUtf16ToUtf8IndexingLines<ConversionKernel::Ascii>(
+            src, length, dest, destOffset, lineOffsets);
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// Convert length UTF-16 code units to UTF-8, writing to dest, which must
+// have room for the whole result (at most 3 chars per code unit).
+// The kernel is picked sampling the beginning of the text.
+// Returns the number of chars written.
+// Throws UnicodeConversionException on invalid UTF-16 (unpaired surrogates).
+//------------------------------------------------------------------------------
+inline size_t TranscodeUtf16ToUtf8(const wchar_t* src, size_t length, char* dest)
+{
+    if (length == 0)
+    {
+        return 0;
+    }
+
+    return TranscodeUtf16ToUtf8With(PickUtf16ToUtf8Kernel(src, length), src, length, dest);
+}
+
+
+//------------------------------------------------------------------------------
+// Length of the UTF-16 block starting at src, of at most blockSize code
+// units, that doesn't split a surrogate pair
+//------------------------------------------------------------------------------
+inline [[nodiscard]] size_t Utf16BlockLength(const wchar_t* src, size_t length, size_t blockSize) noexcept
+{
+    if (length <= blockSize)
+    {
+        return length;
+    }
+
+    // Don't leave a high surrogate at the end of the block
+    const unsigned int last = src[blockSize - 1];
+    return (last >= 0xD800 && last <= 0xDBFF) ? blockSize - 1 : blockSize;
+}
+
+
+
+//------------------------------------------------------------------------------
+// Convert length UTF-8 chars to UTF-16 with the given kernel, writing
+// to dest, which must have room for the whole result (at most one wchar_t
+// per char). Every kernel converts any text; they differ in the fast paths
+// they try, that pay off only on text of the matching composition.
+// Returns the number of wchar_ts written.
+// Throws UnicodeConversionException on invalid UTF-8 sequences.
+//------------------------------------------------------------------------------
+template <ConversionKernel Kernel>
+inline size_t TranscodeUtf8ToUtf16With(const char* src, size_t length, wchar_t* dest)
+{
+    const char* const end = src + length;
+    wchar_t* const destBegin = dest;
+
+    while (src != end)
+    {
+        if constexpr (Kernel == ConversionKernel::Generic)
+        {
+            // ASCII runs between the non-ASCII code points are short:
+            // bulk copies wouldn't pay off
+            if (static_cast<unsigned char>(*src) < 0x80)
+            {
+                *dest++ = static_cast<wchar_t>(*src++);
+                continue;
+            }
+        }
+        else
+        {
+            const size_t runLength = CopyCleanRun<PlainAscii>(src, static_cast<size_t>(end - src), dest);
+            src += runLength;
+            dest += runLength;
+        }
+
+        // Convert the non-ASCII code points up to the next ASCII char
+        while (src != end && static_cast<unsigned char>(*src) >= 0x80)
+        {
+#ifdef UNICODECONVSTD_SSE2
+            if constexpr (Kernel == ConversionKernel::Supplementary)
+            {
+                // Runs of 4-char sequences (e.g. emoji) go through the SIMD kernel
+                if (static_cast<unsigned char>(*src) >= 0xF0)
+                {
+                    const size_t sequenceChars = ConvertFourByteSequencesToUtf16(
+                        src, static_cast<size_t>(end - src), dest);
+                    src += sequenceChars;
+                    dest += sequenceChars / 2;
+                    if (src == end || static_cast<unsigned char>(*src) < 0x80)
+                    {
+                        break;
+                    }
+                }
+            }
+            else if constexpr (Kernel == ConversionKernel::ThreeByte)
+            {
+                // Runs of 3-char sequences (e.g. CJK) go through the fixed-stride kernel
+                if ((static_cast<unsigned char>(*src) & 0xF0) == 0xE0)
+                {
+                    const size_t sequenceChars = ConvertThreeByteSequencesToUtf16(
+                        src, static_cast<size_t>(end - src), dest);
+                    src += sequenceChars;
+                    dest += sequenceChars / 3;
+                    if (src == end || static_cast<unsigned char>(*src) < 0x80)
+                    {
+                        break;
+                    }
+                }
+            }
+#endif
+
+            char32_t codePoint;
+            const size_t sequenceLength = DecodeUtf8(src, end, codePoint);
+            if (sequenceLength == 0)
+            {
+                ThrowConversionError(ERROR_NO_UNICODE_TRANSLATION,
+                    UnicodeConversionException::ConversionType::FromUtf8ToUtf16,
+                    "Invalid UTF-8 sequence.");
+            }
+            src += sequenceLength;
+            dest += EncodeUtf16(codePoint, dest);
+        }
+    }
+
+    return static_cast<size_t>(dest - destBegin);
+}
+
+
+//------------------------------------------------------------------------------
+// Dispatch to the TranscodeUtf8ToUtf16With() instance of the given kernel
+//------------------------------------------------------------------------------
+inline size_t TranscodeUtf8ToUtf16With(
+    ConversionKernel kernel, const char* src, size_t length, wchar_t* dest)
+{
+    switch (kernel)
+    {
+    case ConversionKernel::Generic:
+        return TranscodeUtf8ToUtf16With<ConversionKernel::Generic>(src, length, dest);
+
+    case ConversionKernel::ThreeByte:
+        return TranscodeUtf8ToUtf16With<ConversionKernel::ThreeByte>(src, length, dest);
+
+    case ConversionKernel::Supplementary:
+        return TranscodeUtf8ToUtf16With<ConversionKernel::Supplementary>(src, length, dest);
+
+    default:
+        return TranscodeUtf8ToUtf16With<ConversionKernel::Ascii>(src, length, dest);
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// Convert length UTF-8 chars to UTF-16, writing to dest, which must
+// have room for the whole result (at most one wchar_t per char).
+// The kernel is picked sampling the beginning of the text.
+// Returns the number of wchar_ts written.
+// Throws UnicodeConversionException on invalid UTF-8 sequences.
+//------------------------------------------------------------------------------
+inline size_t TranscodeUtf8ToUtf16(const char* src, size_t length, wchar_t* dest)
+{
+    if (length == 0)
+    {
+        return 0;
+    }
+
+    return TranscodeUtf8ToUtf16With(PickUtf8ToUtf16Kernel(src, length), src, length, dest);
+}
+
+
+//------------------------------------------------------------------------------
+// Length of the UTF-8 block starting at src, of at most blockSize chars,
+// that doesn't split a multi-byte sequence
+//------------------------------------------------------------------------------
+inline [[nodiscard]] size_t Utf8BlockLength(const char* src, size_t length, size_t blockSize) noexcept
+{
+    if (length <= blockSize)
+    {
+        return length;
+    }
+
+    // End the block before the lead byte of the sequence that crosses
+    // the block boundary, if any (sequences have up to 3 continuation bytes)
+    size_t blockEnd = blockSize;
+    while (blockEnd > 0 && blockSize - blockEnd < 3
+        && (static_cast<unsigned char>(src[blockEnd]) & 0xC0) == 0x80)
+    {
+        --blockEnd;
+    }
+
+    // Invalid UTF-8 (too many continuation bytes) is detected by the conversion
+    return (blockEnd > 0 && (static_cast<unsigned char>(src[blockEnd]) & 0xC0) != 0x80)
+        ? blockEnd : blockSize;
+}
+
+
+
+//------------------------------------------------------------------------------
+// Size of the last-level CPU cache, in bytes (8 MB if it can't be queried)
+//------------------------------------------------------------------------------
+inline [[nodiscard]] size_t LastLevelCacheSize()
+{
+    static const size_t cacheSize = []()
+    {
+        constexpr size_t kDefaultCacheSize = 8 * 1024 * 1024;
+
+        DWORD bufferBytes = 0;
+        ::GetLogicalProcessorInformation(nullptr, &bufferBytes);
+        std::vector<SYSTEM_LOGICAL_PROCESSOR_INFORMATION> entries(
+            bufferBytes / sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION));
+        if (entries.empty() || !::GetLogicalProcessorInformation(entries.data(), &bufferBytes))
+        {
+            return kDefaultCacheSize;
+        }
+
+        unsigned int level = 0;
+        size_t size = 0;
+        for (const auto& entry : entries)
+        {
+            if (entry.Relationship == RelationCache && entry.Cache.Level >= level)
+            {
+                size = (entry.Cache.Level > level) ? entry.Cache.Size : (std::max)(size, size_t{ entry.Cache.Size });
+                level = entry.Cache.Level;
+            }
+        }
+        return (size != 0) ? size : kDefaultCacheSize;
+    }();
+    return cacheSize;
+}
+
+
+//------------------------------------------------------------------------------
+// Should a conversion reading the given number of bytes write its output with
+// non-temporal (streaming) stores? Only when its data doesn't fit in the cache:
+// otherwise, ordinary stores are faster, and leave the output in cache.
+//------------------------------------------------------------------------------
+inline [[nodiscard]] bool UseStreamingStores(size_t inputBytes)
+{
+#ifdef UNICODECONVSTD_SSE2
+    return inputBytes >= LastLevelCacheSize();
+#else
+    (void)inputBytes;
+    return false;
+#endif
+}
+
+
+#ifdef UNICODECONVSTD_SSE2
+
+// Size of the staging buffer of the streaming conversions, in bytes:
+// small enough to stay in the L1/L2 cache
+constexpr size_t kStreamingStagingBytes = 16 * 1024;
+
+
+//------------------------------------------------------------------------------
+// Copy length bytes from src to dest with non-temporal stores, which
+// bypass the cache; the unaligned head and tail use ordinary stores
+//------------------------------------------------------------------------------
+inline void StreamingCopy(void* dest, const void* src, size_t length) noexcept
+{
+    char* d = static_cast<char*>(dest);
+    const char* s = static_cast<const char*>(src);
+
+    const size_t head = (std::min)(length, (16 - (reinterpret_cast<std::uintptr_t>(d) & 15)) & 15);
+    std::memcpy(d, s, head);
+    d += head;
+    s += head;
+    length -= head;
+
+    for (; length >= 16; length -= 16, d += 16, s += 16)
+    {
+        _mm_stream_si128(reinterpret_cast<__m128i*>(d), _mm_loadu_si128(reinterpret_cast<const __m128i*>(s)));
+    }
+    std::memcpy(d, s, length);
+}
+
+
+//------------------------------------------------------------------------------
+// Ask the CPU to fetch the given bytes of input, that will be read once,
+// minimizing the cache pollution
+//------------------------------------------------------------------------------
+inline void PrefetchInput(const void* data, size_t bytes) noexcept
+{
+    const char* const p = static_cast<const char*>(data);
+    for (size_t offset = 0; offset < bytes; offset += 64)
+    {
+        _mm_prefetch(p + offset, _MM_HINT_NTA);
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// Convert length UTF-16 code units to UTF-8 for inputs larger than the cache:
+// each block is converted into a cache-resident staging buffer, then copied
+// to dest with non-temporal stores, while the next block of input is
+// prefetched. Same contract as TranscodeUtf16ToUtf8With().
+//------------------------------------------------------------------------------
+inline size_t TranscodeUtf16ToUtf8Streaming(ConversionKernel kernel, const wchar_t* src, size_t length, char* dest)
+{
+    alignas(16) char staging[kStreamingStagingBytes];
+    char* const destBegin = dest;
+
+    while (length != 0)
+    {
+        // Each code unit takes at most 3 UTF-8 chars
+        const size_t blockLength = Utf16BlockLength(src, length, kStreamingStagingBytes / 3);
+        PrefetchInput(src + blockLength, (std::min)(length - blockLength, blockLength) * sizeof(wchar_t));
+
+        const size_t written = TranscodeUtf16ToUtf8With(kernel, src, blockLength, staging);
+        StreamingCopy(dest, staging, written);
+        dest += written;
+        src += blockLength;
+        length -= blockLength;
+    }
+
+    // Make the non-temporal stores globally visible
+    _mm_sfence();
+    return static_cast<size_t>(dest - destBegin);
+}
+
+
+//------------------------------------------------------------------------------
+// Convert length UTF-8 chars to UTF-16 for inputs larger than the cache,
+// with non-temporal stores and input prefetching.
+// Same contract as TranscodeUtf8ToUtf16With().
+//------------------------------------------------------------------------------
+inline size_t TranscodeUtf8ToUtf16Streaming(ConversionKernel kernel, const char* src, size_t length, wchar_t* dest)
+{
+    alignas(16) wchar_t staging[kStreamingStagingBytes / sizeof(wchar_t)];
+    wchar_t* const destBegin = dest;
+
+    while (length != 0)
+    {
+        // Each char produces at most one UTF-16 code unit
+        const size_t blockLength = Utf8BlockLength(src, length, kStreamingStagingBytes / sizeof(wchar_t));
+        PrefetchInput(src + blockLength, (std::min)(length - blockLength, blockLength));
+
+        const size_t written = TranscodeUtf8ToUtf16With(kernel, src, blockLength, staging);
+        StreamingCopy(dest, staging, written * sizeof(wchar_t));
+        dest += written;
+        src += blockLength;
+        length -= blockLength;
+    }
+
+    // Make the non-temporal stores globally visible
+    _mm_sfence();
+    return static_cast<size_t>(dest - destBegin);
+}
+
+#endif // UNICODECONVSTD_SSE2
+
+
+//------------------------------------------------------------------------------
+// Convert from UTF-16 to UTF-8 with the given kernel, with non-temporal
+// stores if requested (and supported)
+//------------------------------------------------------------------------------
+inline size_t TranscodeUtf16ToUtf8With(
+    ConversionKernel kernel, const wchar_t* src, size_t length, char* dest, bool streaming)
+{
+#ifdef UNICODECONVSTD_SSE2
+    if (streaming)
+    {
+        return TranscodeUtf16ToUtf8Streaming(kernel, src, length, dest);
+    }
+#else
+    (void)streaming;
+#endif
+    return TranscodeUtf16ToUtf8With(kernel, src, length, dest);
+}
+
+
+//------------------------------------------------------------------------------
+// Convert from UTF-8 to UTF-16 with the given kernel, with non-temporal
+// stores if requested (and supported)
+//------------------------------------------------------------------------------
+inline size_t TranscodeUtf8ToUtf16With(
+    ConversionKernel kernel, const char* src, size_t length, wchar_t* dest, bool streaming)
+{
+#ifdef UNICODECONVSTD_SSE2
+    if (streaming)
+    {
+        return TranscodeUtf8ToUtf16Streaming(kernel, src, length, dest);
+    }
+#else
+    (void)streaming;
+#endif
+    return TranscodeUtf8ToUtf16With(kernel, src, length, dest);
+}
+
+
+//------------------------------------------------------------------------------
+// Convert a short UTF-16 string (up to kShortStringLength code units)
+// to UTF-8, in a stack buffer. The result string is allocated only if it
+// doesn't fit its small string buffer.
+// Throws UnicodeConversionException on invalid UTF-16.
+//------------------------------------------------------------------------------
+inline [[nodiscard]] std::string ShortToUtf8(const wchar_t* src, size_t length)
+{
+    _ASSERTE(length <= kShortStringLength);
+
+    // Zero-padded copy of the source, so that the whole string
+    // is checked and copied with a single SIMD block
+    wchar_t units[kShortStringLength] = {};
+    std::memcpy(units, src, length * sizeof(wchar_t));
+
+    char buffer[3 * kShortStringLength];
+    size_t utf8Length = length;
+    if (CopyCleanRun<PlainAscii>(units, kShortStringLength, buffer) < length)
+    {
+        // Not only ASCII: convert code point by code point
+        utf8Length = TranscodeUtf16ToUtf8With<ConversionKernel::Generic>(units, length, buffer);
+    }
+    return std::string(buffer, utf8Length);
+}
+
+
+//------------------------------------------------------------------------------
+// Convert a short UTF-8 string (up to kShortStringLength chars)
+// to UTF-16, in a stack buffer. The result string is allocated only if it
+// doesn't fit its small string buffer.
+// Throws UnicodeConversionException on invalid UTF-8.
+//------------------------------------------------------------------------------
+inline [[nodiscard]] std::wstring ShortToUtf16(const char* src, size_t length)
+{
+    _ASSERTE(length <= kShortStringLength);
+
+    // Zero-padded copy of the source, so that the whole string
+    // is checked and copied with a single SIMD block
+    char chars[kShortStringLength] = {};
+    std::memcpy(chars, src, length);
+
+    wchar_t buffer[kShortStringLength];
+    size_t utf16Length = length;
+    if (CopyCleanRun<PlainAscii>(chars, kShortStringLength, buffer) < length)
+    {
+        // Not only ASCII: convert code point by code point
+        utf16Length = TranscodeUtf8ToUtf16With<ConversionKernel::Generic>(chars, length, buffer);
+    }
+    return std::wstring(buffer, utf16Length);
+}
+
+
+//------------------------------------------------------------------------------
+// Convert from UTF-16 to UTF-8 with the Win32 API, in chunks of up to
+// kWin32ChunkLength code units, for inputs longer than INT_MAX.
+// The result string is allocated once, so memory use stays at input plus output.
+// Throws UnicodeConversionException on conversion errors.
+//------------------------------------------------------------------------------
+inline [[nodiscard]] std::string ChunkedToUtf8(const wchar_t* src, size_t length)
+{
+    // Safely fail if an invalid UTF-16 character sequence is encountered
+    constexpr DWORD kFlags = WC_ERR_INVALID_CHARS;
+
+    // Get the length, in chars, of the resulting UTF-8 string, chunk by chunk
+    size_t utf8Length = 0;
+    for (size_t offset = 0; offset < length; )
+    {
+        const size_t chunkLength = Utf16BlockLength(src + offset, length - offset, kWin32ChunkLength);
+        const int chunkUtf8Length = ::WideCharToMultiByte(
+            CP_UTF8, kFlags, src + offset, static_cast<int>(chunkLength), nullptr, 0, nullptr, nullptr);
+        if (chunkUtf8Length == 0)
+        {
+            // Conversion error: capture error code and throw
+            const DWORD errorCode = ::GetLastError();
+            throw UnicodeConversionException(
+                errorCode,
+                UnicodeConversionException::ConversionType::FromUtf16ToUtf8,
+                "Can't get result UTF-8 string length (WideCharToMultiByte failed).");
+        }
+        utf8Length += static_cast<size_t>(chunkUtf8Length);
+        offset += chunkLength;
+    }
+
+    // Do the actual conversion, chunk by chunk, on the same chunk boundaries
+    std::string utf8(utf8Length, ' ');
+    size_t utf8Offset = 0;
+    for (size_t offset = 0; offset < length; )
+    {
+        const size_t chunkLength = Utf16BlockLength(src + offset, length - offset, kWin32ChunkLength);
+        const int result = ::WideCharToMultiByte(
+            CP_UTF8, kFlags, src + offset, static_cast<int>(chunkLength),
+            utf8.data() + utf8Offset, static_cast<int>((std::min)(utf8Length - utf8Offset, 3 * chunkLength)),
+            nullptr, nullptr);
+        if (result == 0)
+        {
+            // Conversion error: capture error code and throw
+            const DWORD errorCode = ::GetLastError();
+            throw UnicodeConversionException(
+                errorCode,
+                UnicodeConversionException::ConversionType::FromUtf16ToUtf8,
+                "Can't convert from UTF-16 to UTF-8 string (WideCharToMultiByte failed).");
+        }
+        utf8Offset += static_cast<size_t>(result);
+        offset += chunkLength;
+    }
+
+    return utf8;
+}
+
+
+//------------------------------------------------------------------------------
+// Convert from UTF-8 to UTF-16 with the Win32 API, in chunks of up to
+// kWin32ChunkLength chars, for inputs longer than INT_MAX.
+// The result string is allocated once, so memory use stays at input plus output.
+// Throws UnicodeConversionException on conversion errors.
+//------------------------------------------------------------------------------
+inline [[nodiscard]] std::wstring ChunkedToUtf16(const char* src, size_t length)
+{
+    // Safely fail if an invalid UTF-8 character sequence is encountered
+    constexpr DWORD kFlags = MB_ERR_INVALID_CHARS;
+
+    // Get the length, in wchar_ts, of the resulting UTF-16 string, chunk by chunk
+    size_t utf16Length = 0;
+    for (size_t offset = 0; offset < length; )
+    {
+        const size_t chunkLength = Utf8BlockLength(src + offset, length - offset, kWin32ChunkLength);
+        const int chunkUtf16Length = ::MultiByteToWideChar(
+            CP_UTF8, kFlags, src + offset, static_cast<int>(chunkLength), nullptr, 0);
+        if (chunkUtf16Length == 0)
+        {
+            // Conversion error: capture error code and throw
+            const DWORD errorCode = ::GetLastError();
+            throw UnicodeConversionException(
+                errorCode,
+                UnicodeConversionException::ConversionType::FromUtf8ToUtf16,
+                "Can't get result UTF-16 string length (MultiByteToWideChar failed).");
+        }
+        utf16Length += static_cast<size_t>(chunkUtf16Length);
+        offset += chunkLength;
+    }
+
+    // Do the actual conversion, chunk by chunk, on the same chunk boundaries
+    std::wstring utf16(utf16Length, L' ');
+    size_t utf16Offset = 0;
+    for (size_t offset = 0; offset < length; )
+    {
+        const size_t chunkLength = Utf8BlockLength(src + offset, length - offset, kWin32ChunkLength);
+        const int result = ::MultiByteToWideChar(
+            CP_UTF8, kFlags, src + offset, static_cast<int>(chunkLength),
+            utf16.data() + utf16Offset, static_cast<int>((std::min)(utf16Length - utf16Offset, chunkLength)));
+        if (result == 0)
+        {
+            // Conversion error: capture error code and throw
+            const DWORD errorCode = ::GetLastError();
+            throw UnicodeConversionException(
+                errorCode,
+                UnicodeConversionException::ConversionType::FromUtf8ToUtf16,
+                "Can't convert from UTF-8 to UTF-16 string (MultiByteToWideChar failed).");
+        }
+        utf16Offset += static_cast<size_t>(result);
+        offset += chunkLength;
+    }
+
+    return utf16;
+}
+
+} // namespace Details
+
+
+#ifdef UNICODECONVSTD_KERNEL_TELEMETRY
+//------------------------------------------------------------------------------
+// Number of conversions done with the given kernel by the portable engine
+// since the program start (or the last reset). Thread-safe.
+// Available when UNICODECONVSTD_KERNEL_TELEMETRY is defined before including
+// this header.
+//------------------------------------------------------------------------------
+inline [[nodiscard]] std::uint64_t KernelSelectionCount(ConversionKernel kernel) noexcept
+{
+    return Details::KernelSelectionCounters()[static_cast<size_t>(kernel)].load(std::memory_order_relaxed);
+}
+
+
+//------------------------------------------------------------------------------
+// Reset the kernel selection counters
+//------------------------------------------------------------------------------
+inline void ResetKernelSelectionCounts() noexcept
+{
+    for (auto& counter : Details::KernelSelectionCounters())
+    {
+        counter.store(0, std::memory_order_relaxed);
+    }
+}
+#endif // UNICODECONVSTD_KERNEL_TELEMETRY
+
+
+//==============================================================================
+//                      Hashing during conversion
+//==============================================================================
+
+//------------------------------------------------------------------------------
+// Hash functions that can be computed while converting
+//------------------------------------------------------------------------------
+enum class HashAlgorithm
+{
+    // 64-bit FNV-1a: simple, and fine for short keys
+    Fnv1a64,
+
+    // 64-bit xxHash (XXH64, seed 0): fast, high quality general purpose hash
+    XxHash64,
+
+    // CRC-32C (Castagnoli), as used by iSCSI, ext4, etc.: computed with the
+    // SSE4.2 CRC32 instruction when the CPU supports it.
+    // The 32-bit CRC is returned in the low bits of the hash value.
+    Crc32c
+};
+
+
+//------------------------------------------------------------------------------
+// Result of ToUtf8WithHash: the converted string and the hash of its bytes
+//------------------------------------------------------------------------------
+struct Utf8WithHash
+{
+    std::string utf8;
+    std::uint64_t hash;
+};
+
+
+namespace Details
+{
+
+inline [[nodiscard]] std::uint64_t RotateLeft64(std::uint64_t value, int bits) noexcept
+{
+    return (value << bits) | (value >> (64 - bits));
+}
+
+
+//------------------------------------------------------------------------------
+// Incremental hashers: the data can be fed in pieces of any size with
+// Update(); Finish() returns the same value as hashing it in one piece.
+//------------------------------------------------------------------------------
+class Fnv1a64Hasher
+{
+public:
+    void Update(const char* data, size_t length) noexcept
+    {
+        std::uint64_t hash = m_hash;
+        for (size_t i = 0; i < length; ++i)
+        {
+            hash ^= static_cast<unsigned char>(data[i]);
+            hash *= 1099511628211ULL;
+        }
+        m_hash = hash;
+    }
+
+    [[nodiscard]] std::uint64_t Finish() const noexcept
+    {
+        return m_hash;
+    }
+
+private:
+    std::uint64_t m_hash = 14695981039346656037ULL;
+};
+
+
+class Crc32cHasher
+{
+public:
+    void Update(const char* data, size_t length) noexcept
+    {
+#ifdef UNICODECONVSTD_SSE2
+        if (GetCpuFeatures().hasSse42)
+        {
+            UpdateSse42(data, length);
+            return;
+        }
+#endif
+
+        static const auto table = []() noexcept
+        {
+            std::array<std::uint32_t, 256> t{};
+            for (std::uint32_t i = 0; i < 256; ++i)
+            {
+                std::uint32_t crc = i;
+                for (int bit = 0; bit < 8; ++bit)
+                {
+                    crc = (crc >> 1) ^ ((crc & 1) ? 0x82F63B78U : 0);
+                }
+                t[i] = crc;
+            }
+            return t;
+        }();
+
+        std::uint32_t crc = m_crc;
+        for (size_t i = 0; i < length; ++i)
+        {
+            crc = (crc >> 8) ^ table[(crc ^ static_cast<unsigned char>(data[i])) & 0xFF];
+        }
+        m_crc = crc;
+    }
+
+    [[nodiscard]] std::uint64_t Finish() const noexcept
+    {
+        return ~m_crc;
+    }
+
+private:
+    std::uint32_t m_crc = 0xFFFFFFFFU;
+
+#ifdef UNICODECONVSTD_SSE2
+    void UpdateSse42(const char* data, size_t length) noexcept
+    {
+        size_t i = 0;
+#ifdef _M_X64
+        std::uint64_t crc = m_crc;
+        for (; length - i >= 8; i += 8)
+        {
+            std::uint64_t chunk;
+            std::memcpy(&chunk, data + i, sizeof(chunk));
+            crc = _mm_crc32_u64(crc, chunk);
+        }
+        m_crc = static_cast<std::uint32_t>(crc);
+#else
+        for (; length - i >= 4; i += 4)
+        {
+            std::uint32_t chunk;
+            std::memcpy(&chunk, data + i, sizeof(chunk));
+            m_crc = _mm_crc32_u32(m_crc, chunk);
+        }
+#endif
+        for (; i < length; ++i)
+        {
+            m_crc = _mm_crc32_u8(m_crc, static_cast<unsigned char>(data[i]));
+        }
+    }
+#endif
+};
+
+
+class XxHash64Hasher
+{
+public:
+    void Update(const char* data, size_t length) noexcept
+    {
+        m_totalLength += length;
+
+        // Complete a partially filled stripe first
+        if (m_bufferedLength != 0)
+        {
+            const size_t count = (std::min)(length, kStripeSize - m_bufferedLength);
+            std::memcpy(m_buffer + m_bufferedLength, data, count);
+            m_bufferedLength += count;
+            data += count;
+            length -= count;
+            if (m_bufferedLength < kStripeSize)
+            {
+                return;
+            }
+            ConsumeStripe(m_buffer);
+            m_bufferedLength = 0;
+        }
+
+        for (; length >= kStripeSize; data += kStripeSize, length -= kStripeSize)
+        {
+            ConsumeStripe(data);
+        }
+
+        std::memcpy(m_buffer, data, length);
+        m_bufferedLength = length;
+    }
+
+    [[nodiscard]] std::uint64_t Finish() const noexcept
+    {
+        std::uint64_t hash;
+        if (m_totalLength >= kStripeSize)
+        {
+            hash = RotateLeft64(m_accumulators[0], 1) + RotateLeft64(m_accumulators[1], 7)
+                + RotateLeft64(m_accumulators[2], 12) + RotateLeft64(m_accumulators[3], 18);
+            for (std::uint64_t accumulator : m_accumulators)
+            {
+                hash = (hash ^ Round(0, accumulator)) * kPrime1 + kPrime4;
+            }
+        }
+        else
+        {
+            hash = kPrime5;
+        }
+        hash += m_totalLength;
+
+        const char* p = m_buffer;
+        const char* const end = m_buffer + m_bufferedLength;
+        for (; end - p >= 8; p += 8)
+        {
+            hash ^= Round(0, Read64(p));
+            hash = RotateLeft64(hash, 27) * kPrime1 + kPrime4;
+        }
+        if (end - p >= 4)
+        {
+            std::uint32_t value;
+            std::memcpy(&value, p, sizeof(value));
+            hash ^= value * kPrime1;
+            hash = RotateLeft64(hash, 23) * kPrime2 + kPrime3;
+            p += 4;
+        }
+        for (; p != end; ++p)
+        {
+            hash ^= static_cast<unsigned char>(*p) * kPrime5;
+            hash = RotateLeft64(hash, 11) * kPrime1;
+        }
+
+        // Final avalanche
+        hash ^= hash >> 33;
+        hash *= kPrime2;
+        hash ^= hash >> 29;
+        hash *= kPrime3;
+        hash ^= hash >> 32;
+        return hash;
+    }
+
+private:
+    static constexpr std::uint64_t kPrime1 = 11400714785074694791ULL;
+    static constexpr std::uint64_t kPrime2 = 14029467366897019727ULL;
+    static constexpr std::uint64_t kPrime3 = 1609587929392839161ULL;
+    static constexpr std::uint64_t kPrime4 = 9650029242287828579ULL;
+    static constexpr std::uint64_t kPrime5 = 2870177450012600261ULL;
+    static constexpr size_t kStripeSize = 32;
+
+    static std::uint64_t Read64(const char* p) noexcept
+    {
+        std::uint64_t value;
+        std::memcpy(&value, p, sizeof(value));
+        return value;
+    }
+
+    static std::uint64_t Round(std::uint64_t accumulator, std::uint64_t input) noexcept
+    {
+        accumulator += input * kPrime2;
+        return RotateLeft64(accumulator, 31) * kPrime1;
+    }
+
+    void ConsumeStripe(const char* stripe) noexcept
+    {
+        for (int i = 0; i < 4; ++i)
+        {
+            m_accumulators[i] = Round(m_accumulators[i], Read64(stripe + 8 * i));
+        }
+    }
+
+    std::uint64_t m_accumulators[4] = { kPrime1 + kPrime2, kPrime2, 0, 0 - kPrime1 };
+    std::uint64_t m_totalLength = 0;
+    char m_buffer[kStripeSize] = {};
+    size_t m_bufferedLength = 0;
+};
+
+
+//------------------------------------------------------------------------------
+// Implementation of ToUtf8WithHash for the given Hasher.
+// The input is converted in blocks, and each block of output is hashed
+// right after it's written, while it's still in the CPU cache.
+//------------------------------------------------------------------------------
+template <typename Hasher>
+inline [[nodiscard]] Utf8WithHash ToUtf8WithHashImpl(std::wstring_view utf16)
+{
+    // Up to 12 KB of output per block: fits in the L1 or L2 cache
+    constexpr size_t kBlockSize = 4096;
+
+    Hasher hasher;
+    std::string utf8(Utf8LengthOfUtf16(utf16.data(), utf16.length()), ' ');
+    size_t utf8Length = 0;
+
+    const ConversionKernel kernel = PickUtf16ToUtf8Kernel(utf16.data(), utf16.length());
+    const wchar_t* src = utf16.data();
+    size_t remaining = utf16.length();
+    while (remaining != 0)
+    {
+        const size_t blockLength = Utf16BlockLength(src, remaining, kBlockSize);
+        char* const blockDest = utf8.data() + utf8Length;
+        const size_t blockUtf8Length = TranscodeUtf16ToUtf8With(kernel, src, blockLength, blockDest);
+        hasher.Update(blockDest, blockUtf8Length);
+
+        src += blockLength;
+        remaining -= blockLength;
+        utf8Length += blockUtf8Length;
+    }
+
+    _ASSERTE(utf8Length == utf8.length());
+    return Utf8WithHash{ std::move(utf8), hasher.Finish() };
+}
+
+
+template <typename Hasher>
+inline [[nodiscard]] std::uint64_t HashBytes(std::string_view data) noexcept
+{
+    Hasher hasher;
+    hasher.Update(data.data(), data.length());
+    return hasher.Finish();
+}
+
+} // namespace Details
+
+
+//------------------------------------------------------------------------------
+// Convert from UTF-16 to UTF-8, also computing the hash of the resulting
+// UTF-8 bytes in the same pass: the output is hashed block by block while
+// it's still in the CPU cache, instead of being read again later.
+// The hash is the same returned by HashUtf8() for the UTF-8 string.
+// Signal errors throwing UnicodeConversionException.
+//------------------------------------------------------------------------------
+inline [[nodiscard]] Utf8WithHash ToUtf8WithHash(
+    std::wstring_view utf16,
+    HashAlgorithm algorithm = HashAlgorithm::XxHash64)
+{
+    switch (algorithm)
+    {
+    case HashAlgorithm::Fnv1a64:
+        return Details::ToUtf8WithHashImpl<Details::Fnv1a64Hasher>(utf16);
+
+    case HashAlgorithm::Crc32c:
+        return Details::ToUtf8WithHashImpl<Details::Crc32cHasher>(utf16);
+
+    default:
+        return Details::ToUtf8WithHashImpl<Details::XxHash64Hasher>(utf16);
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// Hash the bytes of a UTF-8 string with the given algorithm
+//------------------------------------------------------------------------------
+inline [[nodiscard]] std::uint64_t HashUtf8(
+    std::string_view utf8,
+    HashAlgorithm algorithm = HashAlgorithm::XxHash64) noexcept
+{
+    switch (algorithm)
+    {
+    case HashAlgorithm::Fnv1a64:
+        return Details::HashBytes<Details::Fnv1a64Hasher>(utf8);
+
+    case HashAlgorithm::Crc32c:
+        return Details::HashBytes<Details::Crc32cHasher>(utf8);
+
+    default:
+        return Details::HashBytes<Details::XxHash64Hasher>(utf8);
+    }
+}
+
+
+//==============================================================================
+//          Cross-encoding hashing and comparison (without conversion)
+//==============================================================================
+
+namespace Details
+{
+
+//------------------------------------------------------------------------------
+// Hash the UTF-8 encoding of UTF-16 text, without allocating the UTF-8 string:
+// the text is converted in small blocks into a stack buffer.
+// Returns the same value as HashUtf8(ToUtf8(utf16)).
+//------------------------------------------------------------------------------
+template <typename Hasher>
+inline [[nodiscard]] std::uint64_t HashUtf16AsUtf8(std::wstring_view utf16)
+{
+    constexpr size_t kBlockSize = 256;
+    char buffer[3 * kBlockSize];
+
+    Hasher hasher;
+    const ConversionKernel kernel = PickUtf16ToUtf8Kernel(utf16.data(), utf16.length());
+    const wchar_t* src = utf16.data();
+    size_t remaining = utf16.length();
+    while (remaining != 0)
+    {
+        const size_t blockLength = Utf16BlockLength(src, remaining, kBlockSize);
+        hasher.Update(buffer, TranscodeUtf16ToUtf8With(kernel, src, blockLength, buffer));
+        src += blockLength;
+        remaining -= blockLength;
+    }
+    return hasher.Finish();
+}
+
+
+//------------------------------------------------------------------------------
+// Decode a code point, throwing UnicodeConversionException if it's invalid
+//------------------------------------------------------------------------------
+inline size_t DecodeUtf16Checked(const wchar_t* p, const wchar_t* end, char32_t& codePoint)
+{
+    const size_t unitCount = DecodeUtf16(p, end, codePoint);
+    if (unitCount == 0)
+    {
+        ThrowConversionError(ERROR_NO_UNICODE_TRANSLATION,
+            UnicodeConversionException::ConversionType::FromUtf16ToUtf8,
+            "Invalid UTF-16 sequence (unpaired surrogate).");
+    }
+    return unitCount;
+}
+
+inline size_t DecodeUtf8Checked(const char* p, const char* end, char32_t& codePoint)
+{
+    const size_t sequenceLength = DecodeUtf8(p, end, codePoint);
+    if (sequenceLength == 0)
+    {
+        ThrowConversionError(ERROR_NO_UNICODE_TRANSLATION,
+            UnicodeConversionException::ConversionType::FromUtf8ToUtf16,
+            "Invalid UTF-8 sequence.");
+    }
+    return sequenceLength;
+}
+
+
+//------------------------------------------------------------------------------
+// Decode the code point that ends right before p, walking backwards.
+// Returns the number of code units consumed, throws on invalid sequences.
+//------------------------------------------------------------------------------
+inline size_t DecodeUtf16BackwardChecked(const wchar_t* begin, const wchar_t* p, char32_t& codePoint)
+{
+    const unsigned int last = p[-1];
+    const wchar_t* start = p - 1;
+    if (last >= 0xDC00 && last <= 0xDFFF && start != begin)
+    {
+        // Low surrogate: step back to the high surrogate (if any)
+        --start;
+    }
+
+    if (DecodeUtf16Checked(start, p, codePoint) != static_cast<size_t>(p - start))
+    {
+        // An unpaired low surrogate preceded by a BMP code unit
+        ThrowConversionError(ERROR_NO_UNICODE_TRANSLATION,
+            UnicodeConversionException::ConversionType::FromUtf16ToUtf8,
+            "Invalid UTF-16 sequence (unpaired surrogate).");
+    }
+    return static_cast<size_t>(p - start);
+}
+
+inline size_t DecodeUtf8BackwardChecked(const char* begin, const char* p, char32_t& codePoint)
+{
+    // Step back over up to 3 continuation bytes to the lead byte
+    const char* start = p - 1;
+    while (start != begin && p - start < 4 && (static_cast<unsigned char>(*start) & 0xC0) == 0x80)
+    {
+        --start;
+    }
+
+    if (DecodeUtf8Checked(start, p, codePoint) != static_cast<size_t>(p - start))
+    {
+        ThrowConversionError(ERROR_NO_UNICODE_TRANSLATION,
+            UnicodeConversionException::ConversionType::FromUtf8ToUtf16,
+            "Invalid UTF-8 sequence.");
+    }
+    return static_cast<size_t>(p - start);
+}
+
+
+//------------------------------------------------------------------------------
+// Advance utf16Pos and utf8Pos past the longest common prefix (in code points)
+// of the given UTF-16 and UTF-8 texts, stopping at the first difference or
+// at the end of either text.
+// ASCII text is compared 16 code units at a time.
+// Throws UnicodeConversionException on invalid sequences in the compared prefix.
+//------------------------------------------------------------------------------
+inline void SkipCommonPrefix(
+    std::wstring_view utf16, size_t& utf16Pos,
+    std::string_view utf8, size_t& utf8Pos)
+{
+    const wchar_t* const src16 = utf16.data();
+    const char* const src8 = utf8.data();
+
+    for (;;)
+    {
+#ifdef UNICODECONVSTD_SSE2
+        while (utf16.length() - utf16Pos >= 16 && utf8.length() - utf8Pos >= 16)
+        {
+            __m128i bytes16;
+            const unsigned int nonAsciiMask = NarrowUnits16(src16 + utf16Pos, bytes16);
+            const __m128i bytes8 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src8 + utf8Pos));
+
+            // Equal ASCII code units are also equal code points
+            const unsigned int mask = nonAsciiMask
+                | (static_cast<unsigned int>(_mm_movemask_epi8(_mm_cmpeq_epi8(bytes16, bytes8))) ^ 0xFFFF);
+            if (mask != 0)
+            {
+                const size_t asciiLength = LowestSetBit(mask);
+                utf16Pos += asciiLength;
+                utf8Pos += asciiLength;
+                break;
+            }
+            utf16Pos += 16;
+            utf8Pos += 16;
+        }
+#endif
+
+        // Compare code point by code point, up to the next equal ASCII char
+        for (;;)
+        {
+            if (utf16Pos == utf16.length() || utf8Pos == utf8.length())
+            {
+                return;
+            }
+
+            const unsigned int unit = src16[utf16Pos];
+            if (unit < 0x80 && unit == static_cast<unsigned char>(src8[utf8Pos]))
+            {
+                ++utf16Pos;
+                ++utf8Pos;
+                break;
+            }
+
+            char32_t codePoint16;
+            const size_t unitCount = DecodeUtf16Checked(
+                src16 + utf16Pos, src16 + utf16.length(), codePoint16);
+            char32_t codePoint8;
+            const size_t sequenceLength = DecodeUtf8Checked(
+                src8 + utf8Pos, src8 + utf8.length(), codePoint8);
+
+            if (codePoint16 != codePoint8)
+            {
+                return;
+            }
+            utf16Pos += unitCount;
+            utf8Pos += sequenceLength;
+        }
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// Check if UTF-16 and UTF-8 texts represent the same code points
+//------------------------------------------------------------------------------
+inline [[nodiscard]] bool EqualUtf16Utf8(std::wstring_view utf16, std::string_view utf8)
+{
+    // Each UTF-16 code unit takes 1 to 3 UTF-8 chars
+    if (utf8.length() < utf16.length() || utf8.length() / 3 > utf16.length())
+    {
+        return false;
+    }
+
+    size_t utf16Pos = 0;
+    size_t utf8Pos = 0;
+    SkipCommonPrefix(utf16, utf16Pos, utf8, utf8Pos);
+    return utf16Pos == utf16.length() && utf8Pos == utf8.length();
+}
+
+
+
+//------------------------------------------------------------------------------
+// Move utf16End and utf8End backwards past the longest common suffix
+// (in code points) of the given UTF-16 and UTF-8 texts; the mirror image
+// of SkipCommonPrefix.
+//------------------------------------------------------------------------------
+inline void SkipCommonSuffix(
+    std::wstring_view utf16, size_t& utf16End,
+    std::string_view utf8, size_t& utf8End)
+{
+    const wchar_t* const src16 = utf16.data();
+    const char* const src8 = utf8.data();
+
+    for (;;)
+    {
+#ifdef UNICODECONVSTD_SSE2
+        while (utf16End >= 16 && utf8End >= 16)
+        {
+            __m128i bytes16;
+            const unsigned int nonAsciiMask = NarrowUnits16(src16 + utf16End - 16, bytes16);
+            const __m128i bytes8 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src8 + utf8End - 16));
+
+            const unsigned int mask = nonAsciiMask
+                | (static_cast<unsigned int>(_mm_movemask_epi8(_mm_cmpeq_epi8(bytes16, bytes8))) ^ 0xFFFF);
+            if (mask != 0)
+            {
+                const size_t asciiLength = 15 - HighestSetBit(mask);
+                utf16End -= asciiLength;
+                utf8End -= asciiLength;
+                break;
+            }
+            utf16End -= 16;
+            utf8End -= 16;
+        }
+#endif
+
+        for (;;)
+        {
+            if (utf16End == 0 || utf8End == 0)
+            {
+                return;
+            }
+
+            const unsigned int unit = src16[utf16End - 1];
+            if (unit < 0x80 && unit == static_cast<unsigned char>(src8[utf8End - 1]))
+            {
+                --utf16End;
+                --utf8End;
+                break;
+            }
+
+            char32_t codePoint16;
+            const size_t unitCount = DecodeUtf16BackwardChecked(src16, src16 + utf16End, codePoint16);
+            char32_t codePoint8;
+            const size_t sequenceLength = DecodeUtf8BackwardChecked(src8, src8 + utf8End, codePoint8);
+
+            if (codePoint16 != codePoint8)
+            {
+                return;
+            }
+            utf16End -= unitCount;
+            utf8End -= sequenceLength;
+        }
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// Compare UTF-16 and UTF-8 texts in code point order
+//------------------------------------------------------------------------------
+inline [[nodiscard]] int CompareUtf16Utf8(std::wstring_view utf16, std::string_view utf8)
+{
+    size_t utf16Pos = 0;
+    size_t utf8Pos = 0;
+    SkipCommonPrefix(utf16, utf16Pos, utf8, utf8Pos);
+
+    if (utf16Pos == utf16.length())
+    {
+        return (utf8Pos == utf8.length()) ? 0 : -1;
+    }
+    if (utf8Pos == utf8.length())
+    {
+        return 1;
+    }
+
+    // Compare the first different code points
+    char32_t codePoint16;
+    DecodeUtf16Checked(utf16.data() + utf16Pos, utf16.data() + utf16.length(), codePoint16);
+    char32_t codePoint8;
+    DecodeUtf8Checked(utf8.data() + utf8Pos, utf8.data() + utf8.length(), codePoint8);
+    return (codePoint16 < codePoint8) ? -1 : 1;
+}
+
+} // namespace Details
+
+
+//------------------------------------------------------------------------------
+// Hash function object for UTF-8 keys, that also accepts UTF-16 text:
+// a UTF-16 string hashes to the same value as its UTF-8 equivalent,
+// computed on the fly without converting it to a temporary std::string.
+//
+// Together with Utf8Equal, this allows probing an
+// std::unordered_map<std::string, T, Utf8Hash, Utf8Equal> with UTF-16 keys,
+// e.g. map.find(std::wstring_view{ L"key" }), with no conversion or allocation
+// (heterogeneous lookup in unordered containers requires C++20).
+//
+// Hashing UTF-16 text with unpaired surrogates throws UnicodeConversionException.
+//------------------------------------------------------------------------------
+struct Utf8Hash
+{
+    using is_transparent = void;
+
+    [[nodiscard]] size_t operator()(std::string_view utf8) const noexcept
+    {
+        return static_cast<size_t>(HashUtf8(utf8, HashAlgorithm::XxHash64));
+    }
+
+    [[nodiscard]] size_t operator()(std::wstring_view utf16) const
+    {
+        return static_cast<size_t>(Details::HashUtf16AsUtf8<Details::XxHash64Hasher>(utf16));
+    }
+};
+
+
+//------------------------------------------------------------------------------
+// Equality function object for UTF-8 keys, that also accepts UTF-16 text.
+// UTF-16 and UTF-8 strings are compared code point by code point, stopping
+// at the first difference; see Utf8Hash for usage in unordered containers.
+// Invalid sequences found before the first difference throw
+// UnicodeConversionException.
+//------------------------------------------------------------------------------
+struct Utf8Equal
+{
+    using is_transparent = void;
+
+    [[nodiscard]] bool operator()(std::string_view left, std::string_view right) const noexcept
+    {
+        return left == right;
+    }
+
+    [[nodiscard]] bool operator()(std::string_view utf8, std::wstring_view utf16) const
+    {
+        return Details::EqualUtf16Utf8(utf16, utf8);
+    }
+
+    [[nodiscard]] bool operator()(std::wstring_view utf16, std::string_view utf8) const
+    {
+        return Details::EqualUtf16Utf8(utf16, utf8);
+    }
+};
+
+
+//------------------------------------------------------------------------------
+// Cross-encoding comparisons between UTF-16 and UTF-8 text.
+//
+// The texts are decoded on the fly (ASCII runs are compared 16 code units at
+// a time), the comparison stops at the first difference, and nothing is
+// allocated. Invalid sequences found before the first difference throw
+// UnicodeConversionException.
+//------------------------------------------------------------------------------
+
+// Check if the UTF-16 and UTF-8 texts represent the same code points
+inline [[nodiscard]] bool Equal(std::wstring_view utf16, std::string_view utf8)
+{
+    return Details::EqualUtf16Utf8(utf16, utf8);
+}
+
+inline [[nodiscard]] bool Equal(std::string_view utf8, std::wstring_view utf16)
+{
+    return Details::EqualUtf16Utf8(utf16, utf8);
+}
+
+// Compare the texts in code point order (which, unlike UTF-16 code unit order,
+// is the same as UTF-8 byte order). Returns a negative value, zero or
+// a positive value if the first text is less than, equal to or greater
+// than the second one, like std::string::compare.
+inline [[nodiscard]] int Compare(std::wstring_view utf16, std::string_view utf8)
+{
+    return Details::CompareUtf16Utf8(utf16, utf8);
+}
+
+inline [[nodiscard]] int Compare(std::string_view utf8, std::wstring_view utf16)
+{
+    return -Details::CompareUtf16Utf8(utf16, utf8);
+}
+
+// Check if the text begins with the given prefix
+inline [[nodiscard]] bool StartsWith(std::wstring_view utf16Text, std::string_view utf8Prefix)
+{
+    // Each UTF-16 code unit takes at most 3 UTF-8 chars
+    if (utf8Prefix.length() > 3 * utf16Text.length())
+    {
+        return false;
+    }
+
+    size_t utf16Pos = 0;
+    size_t utf8Pos = 0;
+    Details::SkipCommonPrefix(utf16Text, utf16Pos, utf8Prefix, utf8Pos);
+    return utf8Pos == utf8Prefix.length();
+}
+
+inline [[nodiscard]] bool StartsWith(std::string_view utf8Text, std::wstring_view utf16Prefix)
+{
+    // Each UTF-16 code unit takes at least 1 UTF-8 char
+    if (utf16Prefix.length() > utf8Text.length())
+    {
+        return false;
+    }
+
+    size_t utf16Pos = 0;
+    size_t utf8Pos = 0;
+    Details::SkipCommonPrefix(utf16Prefix, utf16Pos, utf8Text, utf8Pos);
+    return utf16Pos == utf16Prefix.length();
+}
+
+// Check if the text ends with the given suffix
+inline [[nodiscard]] bool EndsWith(std::wstring_view utf16Text, std::string_view utf8Suffix)
+{
+    if (utf8Suffix.length() > 3 * utf16Text.length())
+    {
+        return false;
+    }
+
+    size_t utf16End = utf16Text.length();
+    size_t utf8End = utf8Suffix.length();
+    Details::SkipCommonSuffix(utf16Text, utf16End, utf8Suffix, utf8End);
+    return utf8End == 0;
+}
+
+inline [[nodiscard]] bool EndsWith(std::string_view utf8Text, std::wstring_view utf16Suffix)
+{
+    if (utf16Suffix.length() > utf8Text.length())
+    {
+        return false;
+    }
+
+    size_t utf16End = utf16Suffix.length();
+    size_t utf8End = utf8Text.length();
+    Details::SkipCommonSuffix(utf16Suffix, utf16End, utf8Text, utf8End);
+    return utf16End == 0;
+}
+
+
+//==============================================================================
+//                      Cross-encoding substring search
+//==============================================================================
+
+//------------------------------------------------------------------------------
+// Position of a match found by Find(), both as an offset in chars in the
+// UTF-8 text, and as the offset in wchar_ts in the equivalent UTF-16 text
+//------------------------------------------------------------------------------
+struct FindResult
+{
+    static constexpr size_t npos = static_cast<size_t>(-1);
+
+    size_t utf8Offset = npos;
+    size_t utf16Offset = npos;
+
+    [[nodiscard]] bool Found() const noexcept
+    {
+        return utf8Offset != npos;
+    }
+};
+
+
+namespace Details
+{
+
+//------------------------------------------------------------------------------
+// Offset of the first occurrence of needle in haystack, or npos.
+// Candidate positions are those where both the first and the last char of
+// the needle match: they are filtered 16 at a time, and only then compared.
+//------------------------------------------------------------------------------
+inline [[nodiscard]] size_t FindBytes(std::string_view haystack, std::string_view needle) noexcept
+{
+    const size_t needleLength = needle.length();
+    if (needleLength <= 1 || needleLength > haystack.length())
+    {
+        // No pairs of first and last chars to filter on (or no possible match):
+        // fall back to the plain std::string_view::find
+        return haystack.find(needle);
+    }
+
+    const char* const text = haystack.data();
+    const size_t lastStart = haystack.length() - needleLength;
+    size_t i = 0;
+
+#ifdef UNICODECONVSTD_SSE2
+    const __m128i first = _mm_set1_epi8(needle.front());
+    const __m128i last = _mm_set1_epi8(needle.back());
+    for (; lastStart - i >= 15 && i <= lastStart; i += 16)
+    {
+        const __m128i blockFirst = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text + i));
+        const __m128i blockLast = _mm_loadu_si128(
+            reinterpret_cast<const __m128i*>(text + i + needleLength - 1));
+        unsigned int mask = static_cast<unsigned int>(_mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(blockFirst, first), _mm_cmpeq_epi8(blockLast, last))));
+        while (mask != 0)
+        {
+            const size_t candidate = i + LowestSetBit(mask);
+            if (std::memcmp(text + candidate + 1, needle.data() + 1, needleLength - 2) == 0)
+            {
+                return candidate;
+            }
+            mask &= mask - 1;
+        }
+    }
+#endif
+
+    for (; i <= lastStart; ++i)
+    {
+        if (text[i] == needle.front()
+            && text[i + needleLength - 1] == needle.back()
+            && std::memcmp(text + i + 1, needle.data() + 1, needleLength - 2) == 0)
+        {
+            return i;
+        }
+    }
+    return std::string_view::npos;
+}
+
+} // namespace Details
+
+
+//------------------------------------------------------------------------------
+// Find the first occurrence of the UTF-16 needle in the UTF-8 haystack.
+// Only the needle is converted (to UTF-8); the haystack is searched as is,
+// and the UTF-16 offset of the match is computed by counting code points in
+// the haystack prefix, 16 chars at a time.
+// The haystack is not validated: its UTF-8 is assumed to be well-formed.
+// Signal invalid UTF-16 in the needle throwing UnicodeConversionException.
+//------------------------------------------------------------------------------
+inline [[nodiscard]] FindResult Find(std::string_view utf8Haystack, std::wstring_view utf16Needle)
+{
+    std::string utf8Needle(Details::Utf8LengthOfUtf16(utf16Needle.data(), utf16Needle.length()), ' ');
+    Details::TranscodeUtf16ToUtf8(utf16Needle.data(), utf16Needle.length(), utf8Needle.data());
+
+    FindResult result;
+    const size_t utf8Offset = Details::FindBytes(utf8Haystack, utf8Needle);
+    if (utf8Offset != std::string_view::npos)
+    {
+        result.utf8Offset = utf8Offset;
+        result.utf16Offset = Details::Utf16LengthOfUtf8(utf8Haystack.data(), utf8Offset);
+    }
+    return result;
+}
+
+
+//==============================================================================
+//          Code point iterators and lazy transcoding views
+//==============================================================================
+
+namespace Details
+{
+
+// Overloads used by the iterators below, to decode the source text
+// and encode the values they yield, selected by code unit type
+inline size_t DecodeChecked(const char* p, const char* end, char32_t& codePoint)
+{
+    return DecodeUtf8Checked(p, end, codePoint);
+}
+
+inline size_t DecodeChecked(const wchar_t* p, const wchar_t* end, char32_t& codePoint)
+{
+    return DecodeUtf16Checked(p, end, codePoint);
+}
+
+inline size_t EncodeTo(char32_t codePoint, char32_t* dest) noexcept
+{
+    *dest = codePoint;
+    return 1;
+}
+
+inline size_t EncodeTo(char32_t codePoint, wchar_t* dest) noexcept
+{
+    return EncodeUtf16(codePoint, dest);
+}
+
+inline size_t EncodeTo(char32_t codePoint, char* dest) noexcept
+{
+    return EncodeUtf8(codePoint, dest);
+}
+
+
+//------------------------------------------------------------------------------
+// Iterator that lazily decodes text made of SourceChar code units (char for
+// UTF-8, wchar_t for UTF-16), yielding either its code points (char32_t)
+// or the code units of another encoding (wchar_t or char).
+//
+// Each code point is decoded when the iterator reaches it, and invalid
+// sequences throw UnicodeConversionException at that time.
+//------------------------------------------------------------------------------
+template <typename SourceChar, typename ValueType>
+class DecodingIterator
+{
+public:
+    using iterator_category = std::input_iterator_tag;
+#if _MSVC_LANG >= 202002L
+    using iterator_concept = std::forward_iterator_tag;
+#endif
+    using value_type = ValueType;
+    using difference_type = std::ptrdiff_t;
+    using pointer = void;
+    using reference = ValueType;
+
+    DecodingIterator() noexcept = default;
+
+    DecodingIterator(const SourceChar* position, const SourceChar* end)
+        : m_position(position), m_end(end)
+    {
+        Decode();
+    }
+
+    [[nodiscard]] ValueType operator*() const noexcept
+    {
+        return m_values[m_valueIndex];
+    }
+
+    DecodingIterator& operator++()
+    {
+        if (++m_valueIndex == m_valueCount)
+        {
+            m_position += m_sourceLength;
+            Decode();
+        }
+        return *this;
+    }
+
+    DecodingIterator operator++(int)
+    {
+        DecodingIterator previous = *this;
+        ++*this;
+        return previous;
+    }
+
+    [[nodiscard]] bool operator==(const DecodingIterator& other) const noexcept
+    {
+        return m_position == other.m_position && m_valueIndex == other.m_valueIndex;
+    }
+
+    [[nodiscard]] bool operator!=(const DecodingIterator& other) const noexcept
+    {
+        return !(*this == other);
+    }
+
+    // Pointer to the first code unit of the current code point in the source text
+    [[nodiscard]] const SourceChar* Position() const noexcept
+    {
+        return m_position;
+    }
+
+    //--------------------------------------------------------------------------
+    // Fast-forward over the run of ASCII chars at the current position,
+    // which is found 16 code units at a time, and return it.
+    // ASCII chars are the same in all the encodings, so callers can process
+    // the run in bulk instead of char by char.
+    // Must be called on a code point boundary (always true for code point
+    // iterators).
+    //--------------------------------------------------------------------------
+    std::basic_string_view<SourceChar> TakeAsciiRun()
+    {
+        _ASSERTE(m_valueIndex == 0);
+
+        const size_t runLength = AsciiRunLength(m_position, static_cast<size_t>(m_end - m_position));
+        const std::basic_string_view<SourceChar> run(m_position, runLength);
+        if (runLength != 0)
+        {
+            m_position += runLength;
+            Decode();
+        }
+        return run;
+    }
+
+private:
+    const SourceChar* m_position = nullptr;
+    const SourceChar* m_end = nullptr;
+
+    // Code units of the current code point in the source, and the values
+    // that represent it in the output (up to 4 UTF-8 chars)
+    size_t m_sourceLength = 0;
+    ValueType m_values[4] = {};
+    unsigned int m_valueIndex = 0;
+    unsigned int m_valueCount = 0;
+
+    void Decode()
+    {
+        m_valueIndex = 0;
+        if (m_position == m_end)
+        {
+            m_valueCount = 0;
+            return;
+        }
+
+        // Fast path for ASCII
+        if (static_cast<char32_t>(*m_position) < 0x80)
+        {
+            m_values[0] = static_cast<ValueType>(*m_position);
+            m_sourceLength = 1;
+            m_valueCount = 1;
+            return;
+        }
+
+        char32_t codePoint;
+        m_sourceLength = DecodeChecked(m_position, m_end, codePoint);
+        m_valueCount = static_cast<unsigned int>(EncodeTo(codePoint, m_values));
+    }
+};
+
+
+//------------------------------------------------------------------------------
+// Non-owning view over text made of SourceChar code units, iterated with
+// DecodingIterator. Like std::string_view, the viewed text must outlive it.
+//------------------------------------------------------------------------------
+template <typename SourceChar, typename ValueType>
+class DecodingView
+{
+public:
+    using iterator = DecodingIterator<SourceChar, ValueType>;
+    using const_iterator = iterator;
+
+    DecodingView() noexcept = default;
+
+    explicit DecodingView(std::basic_string_view<SourceChar> text) noexcept
+        : m_text(text)
+    {
+    }
+
+    [[nodiscard]] iterator begin() const
+    {
+        return iterator(m_text.data(), m_text.data() + m_text.length());
+    }
+
+    [[nodiscard]] iterator end() const
+    {
+        return iterator(m_text.data() + m_text.length(), m_text.data() + m_text.length());
+    }
+
+    [[nodiscard]] std::basic_string_view<SourceChar> Text() const noexcept
+    {
+        return m_text;
+    }
+
+private:
+    std::basic_string_view<SourceChar> m_text;
+};
+
+} // namespace Details
+
+
+//------------------------------------------------------------------------------
+// Allocation-free views that iterate the code points of UTF-8 or UTF-16 text,
+// or the code units of the text lazily converted to the other encoding:
+//
+//      for (char32_t codePoint : Utf8View(utf8)) ...
+//      for (wchar_t unit : Utf8View(utf8) | AsUtf16) ...
+//      std::string utf8(utf16View.begin(), utf16View.end()) ...
+//
+// Iterators decode on the fly, so transcoding can be composed into pipelines
+// without intermediate strings; TakeAsciiRun() fast-forwards over ASCII runs.
+// Invalid sequences throw UnicodeConversionException when they're reached.
+// With C++20, these are borrowed std::ranges views.
+//------------------------------------------------------------------------------
+using Utf8View = Details::DecodingView<char, char32_t>;
+using Utf16View = Details::DecodingView<wchar_t, char32_t>;
+using Utf8AsUtf16View = Details::DecodingView<char, wchar_t>;
+using Utf16AsUtf8View = Details::DecodingView<wchar_t, char>;
+
+// Range adaptors for the transcoding views
+struct AsUtf16Adaptor {};
+struct AsUtf8Adaptor {};
+inline constexpr AsUtf16Adaptor AsUtf16{};
+inline constexpr AsUtf8Adaptor AsUtf8{};
+
+inline [[nodiscard]] Utf8AsUtf16View operator|(Utf8View utf8, AsUtf16Adaptor) noexcept
+{
+    return Utf8AsUtf16View(utf8.Text());
+}
+
+inline [[nodiscard]] Utf16AsUtf8View operator|(Utf16View utf16, AsUtf8Adaptor) noexcept
+{
+    return Utf16AsUtf8View(utf16.Text());
+}
+
+
+
+//==============================================================================
+//                      Sink-based conversions
+//==============================================================================
+
+namespace Details
+{
+
+// Size of the internal output buffer of the sink-based conversions, in bytes
+constexpr size_t kSinkBlockBytes = 16 * 1024;
+
+} // namespace Details
+
+
+//------------------------------------------------------------------------------
+// Convert from UTF-16 to UTF-8, sending the output to sink instead of
+// building a string: the output is produced in an internal fixed-size
+// buffer (16 KB), and passed to the sink in blocks, with calls to:
+//
+//      sink.write(const char* data, size_t length)
+//
+// The sink can be a socket buffer, a hasher, a ring buffer, etc.
+// Signal errors throwing UnicodeConversionException (the sink may have
+// already received the output that precedes the invalid sequence).
+//------------------------------------------------------------------------------
+template <typename Sink>
+inline void ToUtf8(std::wstring_view utf16, Sink& sink)
+{
+    constexpr size_t kBufferLength = Details::kSinkBlockBytes;
+
+    // Convert at least this many code units at a time
+    constexpr size_t kMinBlockUnits = 256;
+
+    char buffer[kBufferLength];
+    size_t bufferUsed = 0;
+
+    const ConversionKernel kernel = Details::PickUtf16ToUtf8Kernel(utf16.data(), utf16.length());
+    const wchar_t* src = utf16.data();
+    size_t remaining = utf16.length();
+    while (remaining != 0)
+    {
+        // Each code unit takes at most 3 UTF-8 chars
+        size_t room = kBufferLength - bufferUsed;
+        if (room < 3 * kMinBlockUnits)
+        {
+            sink.write(static_cast<const char*>(buffer), bufferUsed);
+            bufferUsed = 0;
+            room = kBufferLength;
+        }
+
+        const size_t blockLength = Details::Utf16BlockLength(src, remaining, room / 3);
+        bufferUsed += Details::TranscodeUtf16ToUtf8With(kernel, src, blockLength, buffer + bufferUsed);
+        src += blockLength;
+        remaining -= blockLength;
+    }
+
+    if (bufferUsed != 0)
+    {
+        sink.write(static_cast<const char*>(buffer), bufferUsed);
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// Convert from UTF-8 to UTF-16, sending the output to sink in blocks,
+// with calls to:
+//
+//      sink.write(const wchar_t* data, size_t length)
+//
+// See the UTF-16 to UTF-8 sink-based ToUtf8() for details.
+//------------------------------------------------------------------------------
+template <typename Sink>
+inline void ToUtf16(std::string_view utf8, Sink& sink)
+{
+    constexpr size_t kBufferLength = Details::kSinkBlockBytes / sizeof(wchar_t);
+    constexpr size_t kMinBlockChars = 256;
+
+    wchar_t buffer[kBufferLength];
+    size_t bufferUsed = 0;
+
+    const ConversionKernel kernel = Details::PickUtf8ToUtf16Kernel(utf8.data(), utf8.length());
+    const char* src = utf8.data();
+    size_t remaining = utf8.length();
+    while (remaining != 0)
+    {
+        // Each char produces at most one UTF-16 code unit
+        size_t room = kBufferLength - bufferUsed;
+        if (room < kMinBlockChars)
+        {
+            sink.write(static_cast<const wchar_t*>(buffer), bufferUsed);
+            bufferUsed = 0;
+            room = kBufferLength;
+        }
+
+        const size_t blockLength = Details::Utf8BlockLength(src, remaining, room);
+        bufferUsed += Details::TranscodeUtf8ToUtf16With(kernel, src, blockLength, buffer + bufferUsed);
+        src += blockLength;
+        remaining -= blockLength;
+    }
+
+    if (bufferUsed != 0)
+    {
+        sink.write(static_cast<const wchar_t*>(buffer), bufferUsed);
+    }
+}
+
+
+
+//==============================================================================
+//                  Segmented (rope) output for large conversions
+//==============================================================================
+
+//------------------------------------------------------------------------------
+// Options for the segmented conversions
+//------------------------------------------------------------------------------
+enum class OutputStoreMode
+{
+    Automatic,      // non-temporal stores for inputs larger than the last-level cache
+    Cached,         // ordinary stores
+    NonTemporal     // non-temporal (streaming) stores, bypassing the cache
+};
+
+struct SegmentedOutputOptions
+{
+    // Size of each block, in bytes
+    size_t blockBytes = 1024 * 1024;
+
+    // How the output is stored: non-temporal stores don't evict useful data
+    // from the cache, when the output is too large to stay there anyway
+    OutputStoreMode storeMode = OutputStoreMode::Automatic;
+
+    // Back the blocks with large pages, if the process holds the
+    // SeLockMemoryPrivilege privilege (otherwise, regular pages are used)
+    bool useLargePages = false;
+};
+
+
+//------------------------------------------------------------------------------
+// A segment of text, stored in one of the blocks of a segmented string
+//------------------------------------------------------------------------------
+template <typename CharType>
+struct TextSegment
+{
+    const CharType* data;
+    size_t length;
+};
+
+
+namespace Details
+{
+
+//------------------------------------------------------------------------------
+// Allocate the given number of bytes of committed memory directly from
+// the OS, trying large pages first if requested.
+// On return, bytes is rounded up to the page size that was used,
+// and usedLargePages tells if the block is backed by large pages.
+// Throws std::bad_alloc on failure.
+//------------------------------------------------------------------------------
+inline [[nodiscard]] void* AllocatePages(size_t& bytes, bool useLargePages, bool& usedLargePages)
+{
+    usedLargePages = false;
+
+    if (useLargePages)
+    {
+        // Large page allocations must be a multiple of the large page size;
+        // GetLargePageMinimum() returns 0 if large pages aren't supported
+        const size_t largePageSize = ::GetLargePageMinimum();
+        if (largePageSize != 0)
+        {
+            const size_t largeBytes = (bytes + largePageSize - 1) / largePageSize * largePageSize;
+            void* const block = ::VirtualAlloc(nullptr, largeBytes,
+                MEM_COMMIT | MEM_RESERVE | MEM_LARGE_PAGES, PAGE_READWRITE);
+            if (block != nullptr)
+            {
+                bytes = largeBytes;
+                usedLargePages = true;
+                return block;
+            }
+        }
+    }
+
+    // VirtualAlloc rounds the size up to the (regular) page size
+    void* const block = ::VirtualAlloc(nullptr, bytes, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    if (block == nullptr)
+    {
+        throw std::bad_alloc();
+    }
+    return block;
+}
+
+
+//------------------------------------------------------------------------------
+// Release a block allocated with AllocatePages()
+//------------------------------------------------------------------------------
+inline void FreePages(void* block) noexcept
+{
+    ::VirtualFree(block, 0, MEM_RELEASE);
+}
+
+
+//------------------------------------------------------------------------------
+// Text stored in a chain of fixed-size blocks, allocated directly from
+// the OS: growing it never reallocates or copies the text already stored.
+// Move-only; the blocks are released on destruction.
+//------------------------------------------------------------------------------
+template <typename CharType>
+class SegmentedText
+{
+public:
+    // Blocks are at least this large, in bytes
+    static constexpr size_t kMinBlockBytes = 4096;
+
+    SegmentedText() noexcept = default;
+
+    explicit SegmentedText(const SegmentedOutputOptions& options) noexcept
+        : m_blockBytes((std::max)(options.blockBytes, kMinBlockBytes))
+        , m_useLargePages(options.useLargePages)
+    {
+    }
+
+    SegmentedText(SegmentedText&& other) noexcept
+        : m_segments(std::move(other.m_segments))
+        , m_blockBytes(other.m_blockBytes)
+        , m_useLargePages(other.m_useLargePages)
+        , m_usesLargePages(other.m_usesLargePages)
+        , m_lastBlockCapacity(std::exchange(other.m_lastBlockCapacity, 0))
+        , m_length(std::exchange(other.m_length, 0))
+    {
+        other.m_segments.clear();
+    }
+
+    SegmentedText& operator=(SegmentedText&& other) noexcept
+    {
+        if (this != &other)
+        {
+            Release();
+            m_segments = std::move(other.m_segments);
+            other.m_segments.clear();
+            m_blockBytes = other.m_blockBytes;
+            m_useLargePages = other.m_useLargePages;
+            m_usesLargePages = other.m_usesLargePages;
+            m_lastBlockCapacity = std::exchange(other.m_lastBlockCapacity, 0);
+            m_length = std::exchange(other.m_length, 0);
+        }
+        return *this;
+    }
+
+    SegmentedText(const SegmentedText&) = delete;
+    SegmentedText& operator=(const SegmentedText&) = delete;
+
+    ~SegmentedText()
+    {
+        Release();
+    }
+
+    // The segments of the text, one per block, in order: they can be
+    // passed as they are to gather writes (e.g. WSASend with WSABUFs)
+    [[nodiscard]] const std::vector<TextSegment<CharType>>& Segments() const noexcept
+    {
+        return m_segments;
+    }
+
+    // Total length of the text, in code units
+    [[nodiscard]] size_t Length() const noexcept
+    {
+        return m_length;
+    }
+
+    // Does any block use large pages?
+    [[nodiscard]] bool UsesLargePages() const noexcept
+    {
+        return m_usesLargePages;
+    }
+
+    // Copy the text to a contiguous string
+    [[nodiscard]] std::basic_string<CharType> ToString() const
+    {
+        std::basic_string<CharType> text;
+        text.reserve(m_length);
+        for (const auto& segment : m_segments)
+        {
+            text.append(segment.data, segment.length);
+        }
+        return text;
+    }
+
+    //
+    // Low-level interface used by the segmented conversions, to write
+    // the output directly to the blocks
+    //
+
+    // Room left in the last block, in code units
+    [[nodiscard]] size_t AvailableRoom() const noexcept
+    {
+        return m_segments.empty() ? 0 : m_lastBlockCapacity - m_segments.back().length;
+    }
+
+    // Where the next code units are written, in the last block
+    [[nodiscard]] CharType* WritePosition() noexcept
+    {
+        _ASSERTE(!m_segments.empty());
+        TextSegment<CharType>& last = m_segments.back();
+        return const_cast<CharType*>(last.data) + last.length;
+    }
+
+    // Add the given number of code units, written at WritePosition(), to the text
+    void CommitWritten(size_t length) noexcept
+    {
+        _ASSERTE(length <= AvailableRoom());
+        m_segments.back().length += length;
+        m_length += length;
+    }
+
+    // Start a new block; the room left in the previous one is not used
+    void AddBlock()
+    {
+        m_segments.reserve(m_segments.size() + 1);
+
+        size_t bytes = m_blockBytes;
+        bool usedLargePages = false;
+        void* const block = AllocatePages(bytes, m_useLargePages, usedLargePages);
+        m_segments.push_back(TextSegment<CharType>{ static_cast<const CharType*>(block), 0 });
+        m_lastBlockCapacity = bytes / sizeof(CharType);
+        m_usesLargePages = m_usesLargePages || usedLargePages;
+    }
+
+private:
+    std::vector<TextSegment<CharType>> m_segments;
+    size_t m_blockBytes = SegmentedOutputOptions{}.blockBytes;
+    bool m_useLargePages = false;
+    bool m_usesLargePages = false;
+    size_t m_lastBlockCapacity = 0;
+    size_t m_length = 0;
+
+    void Release() noexcept
+    {
+        for (const auto& segment : m_segments)
+        {
+            FreePages(const_cast<CharType*>(segment.data));
+        }
+    }
+};
+
+} // namespace Details
+
+
+// UTF-8 and UTF-16 text stored in a chain of blocks
+using SegmentedUtf8 = Details::SegmentedText<char>;
+using SegmentedUtf16 = Details::SegmentedText<wchar_t>;
+
+
+namespace Details
+{
+
+//------------------------------------------------------------------------------
+// Convert length UTF-16 code units (not ending in the middle of a surrogate
+// pair) to UTF-8 with the given kernel, appending the output to the blocks
+// of utf8, optionally with non-temporal stores
+//------------------------------------------------------------------------------
+inline void AppendUtf8Segmented(SegmentedUtf8& utf8, const wchar_t* src, size_t length,
+    ConversionKernel kernel, bool streaming)
+{
+    // Convert at least this many code units at a time; the room left
+    // at the end of a block, if smaller, is not used
+    constexpr size_t kMinBlockUnits = 16;
+
+    while (length != 0)
+    {
+        // Each code unit takes at most 3 UTF-8 chars
+        const size_t maxUnits = utf8.AvailableRoom() / 3;
+        if (maxUnits < kMinBlockUnits)
+        {
+            utf8.AddBlock();
+            continue;
+        }
+
+        const size_t blockLength = Utf16BlockLength(src, length, maxUnits);
+        utf8.CommitWritten(TranscodeUtf16ToUtf8With(kernel, src, blockLength, utf8.WritePosition(), streaming));
+        src += blockLength;
+        length -= blockLength;
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// Convert length UTF-8 chars (not ending in the middle of a sequence)
+// to UTF-16 with the given kernel, appending the output to the blocks
+// of utf16, optionally with non-temporal stores
+//------------------------------------------------------------------------------
+inline void AppendUtf16Segmented(SegmentedUtf16& utf16, const char* src, size_t length,
+    ConversionKernel kernel, bool streaming)
+{
+    constexpr size_t kMinBlockChars = 16;
+
+    while (length != 0)
+    {
+        // Each char produces at most one UTF-16 code unit
+        const size_t maxChars = utf16.AvailableRoom();
+        if (maxChars < kMinBlockChars)
+        {
+            utf16.AddBlock();
+            continue;
+        }
+
+        const size_t blockLength = Utf8BlockLength(src, length, maxChars);
+        utf16.CommitWritten(TranscodeUtf8ToUtf16With(kernel, src, blockLength, utf16.WritePosition(), streaming));
+        src += blockLength;
+        length -= blockLength;
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// Should a segmented conversion of the given input size use non-temporal stores?
+//------------------------------------------------------------------------------
+inline [[nodiscard]] bool UseStreamingStores(OutputStoreMode storeMode, size_t inputBytes)
+{
+    switch (storeMode)
+    {
+    case OutputStoreMode::Cached:
+        return false;
+
+    case OutputStoreMode::NonTemporal:
+        return true;
+
+    default:
+        return UseStreamingStores(inputBytes);
+    }
+}
+
+} // namespace Details
+
+
+//------------------------------------------------------------------------------
+// Convert from UTF-16 to UTF-8, storing the output in a chain of fixed-size
+// blocks (1 MB by default, optionally backed by large pages) instead of
+// a contiguous string: there are no huge allocations, and no reallocation
+// copies. The segments can be written out with gather I/O.
+// Signal errors throwing UnicodeConversionException.
+//------------------------------------------------------------------------------
+inline [[nodiscard]] SegmentedUtf8 ToUtf8Segmented(std::wstring_view utf16,
+    const SegmentedOutputOptions& options = {})
+{
+    SegmentedUtf8 utf8(options);
+    Details::AppendUtf8Segmented(utf8, utf16.data(), utf16.length(),
+        Details::PickUtf16ToUtf8Kernel(utf16.data(), utf16.length()),
+        Details::UseStreamingStores(options.storeMode, utf16.length() * sizeof(wchar_t)));
+    return utf8;
+}
+
+
+//------------------------------------------------------------------------------
+// Convert from UTF-8 to UTF-16, storing the output in a chain of fixed-size
+// blocks. See ToUtf8Segmented() for details.
+//------------------------------------------------------------------------------
+inline [[nodiscard]] SegmentedUtf16 ToUtf16Segmented(std::string_view utf8,
+    const SegmentedOutputOptions& options = {})
+{
+    SegmentedUtf16 utf16(options);
+    Details::AppendUtf16Segmented(utf16, utf8.data(), utf8.length(),
+        Details::PickUtf8ToUtf16Kernel(utf8.data(), utf8.length()),
+        Details::UseStreamingStores(options.storeMode, utf8.length()));
+    return utf16;
+}
+
+
+//==============================================================================
+//              Scatter/gather input: conversions from segment lists
+//==============================================================================
+
+namespace Details
+{
+
+//------------------------------------------------------------------------------
+// View of the text of an input segment: a TextSegment, or anything
+// convertible to a string view (std::wstring, std::string_view, etc.)
+//------------------------------------------------------------------------------
+template <typename CharType, typename Segment>
+inline [[nodiscard]] std::basic_string_view<CharType> SegmentText(const Segment& segment) noexcept
+{
+    if constexpr (std::is_same_v<std::decay_t<Segment>, TextSegment<CharType>>)
+    {
+        return std::basic_string_view<CharType>(segment.data, segment.length);
+    }
+    else
+    {
+        return std::basic_string_view<CharType>(segment);
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// Expected length of the UTF-8 sequence starting with the given lead byte
+// (1 for ASCII, and for invalid lead bytes, rejected by the conversion)
+//------------------------------------------------------------------------------
+inline [[nodiscard]] size_t Utf8SequenceLength(unsigned int leadByte) noexcept
+{
+    if (leadByte >= 0xC0 && leadByte <= 0xDF)
+    {
+        return 2;
+    }
+    if (leadByte >= 0xE0 && leadByte <= 0xEF)
+    {
+        return 3;
+    }
+    if (leadByte >= 0xF0 && leadByte <= 0xF7)
+    {
+        return 4;
+    }
+    return 1;
+}
+
+
+//------------------------------------------------------------------------------
+// Call convert(const wchar_t* src, size_t length) on the UTF-16 text of the
+// segments, in order, in pieces that don't split surrogate pairs: a pair
+// split between two segments is passed on its own, from a small carry buffer.
+// The segments themselves are never copied.
+//------------------------------------------------------------------------------
+template <typename SegmentRange, typename Converter>
+inline void ForEachGatheredUtf16Piece(const SegmentRange& utf16Segments, Converter convert)
+{
+    wchar_t pendingHighSurrogate = 0;
+    for (const auto& segment : utf16Segments)
+    {
+        const std::wstring_view text = SegmentText<wchar_t>(segment);
+        const wchar_t* src = text.data();
+        size_t length = text.length();
+        if (length == 0)
+        {
+            continue;
+        }
+
+        // Complete the surrogate pair started in the previous segment
+        // (an invalid low surrogate is rejected by the conversion)
+        if (pendingHighSurrogate != 0)
+        {
+            const wchar_t pair[2] = { pendingHighSurrogate, *src };
+            convert(pair, 2);
+            pendingHighSurrogate = 0;
+            ++src;
+            --length;
+        }
+
+        // Keep a high surrogate at the end of the segment for the next one
+        if (length != 0 && src[length - 1] >= 0xD800 && src[length - 1] <= 0xDBFF)
+        {
+            pendingHighSurrogate = src[length - 1];
+            --length;
+        }
+
+        if (length != 0)
+        {
+            convert(src, length);
+        }
+    }
+
+    // An unpaired high surrogate at the end of the text is rejected by the conversion
+    if (pendingHighSurrogate != 0)
+    {
+        convert(&pendingHighSurrogate, 1);
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// Call convert(const char* src, size_t length) on the UTF-8 text of the
+// segments, in order, in pieces that don't split sequences: a sequence split
+// between segments (even more than two) is passed on its own, from a small
+// carry buffer. The segments themselves are never copied.
+//------------------------------------------------------------------------------
+template <typename SegmentRange, typename Converter>
+inline void ForEachGatheredUtf8Piece(const SegmentRange& utf8Segments, Converter convert)
+{
+    char carry[4];
+    size_t carryLength = 0;
+    size_t carrySequenceLength = 0;
+    for (const auto& segment : utf8Segments)
+    {
+        const std::string_view text = SegmentText<char>(segment);
+        const char* src = text.data();
+        size_t length = text.length();
+        if (length == 0)
+        {
+            continue;
+        }
+
+        // Complete the sequence started in the previous segments
+        // (invalid continuation bytes are rejected by the conversion)
+        if (carryLength != 0)
+        {
+            const size_t taken = (std::min)(carrySequenceLength - carryLength, length);
+            std::memcpy(carry + carryLength, src, taken);
+            carryLength += taken;
+            src += taken;
+            length -= taken;
+            if (carryLength < carrySequenceLength)
+            {
+                continue;
+            }
+            convert(static_cast<const char*>(carry), carryLength);
+            carryLength = 0;
+        }
+
+        // Keep a sequence incomplete at the end of the segment for the next one:
+        // look for its lead byte among the last 3 chars
+        size_t completeLength = length;
+        for (size_t back = 1; back <= 3 && back <= length; ++back)
+        {
+            const unsigned int byte = static_cast<unsigned char>(src[length - back]);
+            if ((byte & 0xC0) != 0x80)
+            {
+                if (Utf8SequenceLength(byte) > back)
+                {
+                    completeLength = length - back;
+                    carrySequenceLength = Utf8SequenceLength(byte);
+                }
+                break;
+            }
+        }
+        if (completeLength != length)
+        {
+            carryLength = length - completeLength;
+            std::memcpy(carry, src + completeLength, carryLength);
+        }
+
+        if (completeLength != 0)
+        {
+            convert(src, completeLength);
+        }
+    }
+
+    // A truncated sequence at the end of the text is rejected by the conversion
+    if (carryLength != 0)
+    {
+        convert(static_cast<const char*>(carry), carryLength);
+    }
+}
+
+} // namespace Details
+
+
+//------------------------------------------------------------------------------
+// Convert from UTF-16 to UTF-8 the text of a sequence of input segments
+// (e.g. the buffers of a network message), as if they were concatenated,
+// but without a gather copy: code points can span segment boundaries.
+// The segments can be TextSegment<wchar_t>s, or anything convertible to
+// std::wstring_view; the sequence is iterated twice (sizing, conversion).
+// Signal errors throwing UnicodeConversionException.
+//------------------------------------------------------------------------------
+template <typename SegmentRange>
+inline [[nodiscard]] std::string GatherToUtf8(const SegmentRange& utf16Segments)
+{
+    // The UTF-8 length of each code unit doesn't depend on the others,
+    // so the lengths of the segments add up exactly
+    size_t utf8Length = 0;
+    size_t inputBytes = 0;
+    ConversionKernel kernel = ConversionKernel::Ascii;
+    for (const auto& segment : utf16Segments)
+    {
+        const std::wstring_view text = Details::SegmentText<wchar_t>(segment);
+        utf8Length += Details::Utf8LengthOfUtf16(text.data(), text.length());
+
+        // The kernel is picked once, from the beginning of the text
+        if (inputBytes == 0)
+        {
+            kernel = Details::PickUtf16ToUtf8Kernel(text.data(), text.length());
+        }
+        inputBytes += text.length() * sizeof(wchar_t);
+    }
+
+    std::string utf8(utf8Length, ' ');
+    char* dest = utf8.data();
+    const bool streaming = Details::UseStreamingStores(inputBytes);
+    Details::ForEachGatheredUtf16Piece(utf16Segments, [&dest, kernel, streaming](const wchar_t* src, size_t length)
+    {
+        dest += Details::TranscodeUtf16ToUtf8With(kernel, src, length, dest, streaming);
+    });
+    return utf8;
+}
+
+
+//------------------------------------------------------------------------------
+// Convert from UTF-8 to UTF-16 the text of a sequence of input segments,
+// as if they were concatenated, without a gather copy.
+// See GatherToUtf8() for details.
+//------------------------------------------------------------------------------
+template <typename SegmentRange>
+inline [[nodiscard]] std::wstring GatherToUtf16(const SegmentRange& utf8Segments)
+{
+    // Each char adds to the UTF-16 length independently of the others
+    size_t utf16Length = 0;
+    size_t inputBytes = 0;
+    ConversionKernel kernel = ConversionKernel::Ascii;
+    for (const auto& segment : utf8Segments)
+    {
+        const std::string_view text = Details::SegmentText<char>(segment);
+        utf16Length += Details::Utf16LengthOfUtf8(text.data(), text.length());
+
+        // The kernel is picked once, from the beginning of the text
+        if (inputBytes == 0)
+        {
+            kernel = Details::PickUtf8ToUtf16Kernel(text.data(), text.length());
+        }
+        inputBytes += text.length();
+    }
+
+    std::wstring utf16(utf16Length, L' ');
+    wchar_t* dest = utf16.data();
+    const bool streaming = Details::UseStreamingStores(inputBytes);
+    Details::ForEachGatheredUtf8Piece(utf8Segments, [&dest, kernel, streaming](const char* src, size_t length)
+    {
+        dest += Details::TranscodeUtf8ToUtf16With(kernel, src, length, dest, streaming);
+    });
+    return utf16;
+}
+
+
+//------------------------------------------------------------------------------
+// Convert from UTF-16 to UTF-8 the text of a sequence of input segments,
+// storing the output in a chain of fixed-size blocks: scatter/gather
+// conversion, with no contiguous copy of either the input or the output.
+// The sequence of segments is iterated twice (input size, conversion).
+// Signal errors throwing UnicodeConversionException.
+//------------------------------------------------------------------------------
+template <typename SegmentRange>
+inline [[nodiscard]] SegmentedUtf8 GatherToUtf8Segmented(const SegmentRange& utf16Segments,
+    const SegmentedOutputOptions& options = {})
+{
+    size_t inputBytes = 0;
+    ConversionKernel kernel = ConversionKernel::Ascii;
+    for (const auto& segment : utf16Segments)
+    {
+        const std::wstring_view text = Details::SegmentText<wchar_t>(segment);
+
+        // The kernel is picked once, from the beginning of the text
+        if (inputBytes == 0)
+        {
+            kernel = Details::PickUtf16ToUtf8Kernel(text.data(), text.length());
+        }
+        inputBytes += text.length() * sizeof(wchar_t);
+    }
+
+    SegmentedUtf8 utf8(options);
+    const bool streaming = Details::UseStreamingStores(options.storeMode, inputBytes);
+    Details::ForEachGatheredUtf16Piece(utf16Segments, [&utf8, kernel, streaming](const wchar_t* src, size_t length)
+    {
+        Details::AppendUtf8Segmented(utf8, src, length, kernel, streaming);
+    });
+    return utf8;
+}
+
+
+//------------------------------------------------------------------------------
+// Convert from UTF-8 to UTF-16 the text of a sequence of input segments,
+// storing the output in a chain of fixed-size blocks.
+// See GatherToUtf8Segmented() for details.
+//------------------------------------------------------------------------------
+template <typename SegmentRange>
+inline [[nodiscard]] SegmentedUtf16 GatherToUtf16Segmented(const SegmentRange& utf8Segments,
+    const SegmentedOutputOptions& options = {})
+{
+    size_t inputBytes = 0;
+    ConversionKernel kernel = ConversionKernel::Ascii;
+    for (const auto& segment : utf8Segments)
+    {
+        const std::string_view text = Details::SegmentText<char>(segment);
+
+        // The kernel is picked once, from the beginning of the text
+        if (inputBytes == 0)
+        {
+            kernel = Details::PickUtf8ToUtf16Kernel(text.data(), text.length());
+        }
+        inputBytes += text.length();
+    }
+
+    SegmentedUtf16 utf16(options);
+    const bool streaming = Details::UseStreamingStores(options.storeMode, inputBytes);
+    Details::ForEachGatheredUtf8Piece(utf8Segments, [&utf16, kernel, streaming](const char* src, size_t length)
+    {
+        Details::AppendUtf16Segmented(utf16, src, length, kernel, streaming);
+    });
+    return utf16;
+}
+
+
+
+//==============================================================================
+//              Large-page-backed output strings for large conversions
+//==============================================================================
+
+//------------------------------------------------------------------------------
+// Enable the SeLockMemoryPrivilege privilege in the process token, required
+// to allocate large pages. The privilege must have been granted to the user
+// account (Local Security Policy: "Lock pages in memory").
+// Returns true if large page allocations are possible.
+//------------------------------------------------------------------------------
+inline bool EnableLargePages() noexcept
+{
+    if (::GetLargePageMinimum() == 0)
+    {
+        return false;
+    }
+
+    HANDLE token = nullptr;
+    if (!::OpenProcessToken(::GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token))
+    {
+        return false;
+    }
+
+    TOKEN_PRIVILEGES privileges = {};
+    privileges.PrivilegeCount = 1;
+    privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+
+    // AdjustTokenPrivileges succeeds with ERROR_NOT_ALL_ASSIGNED
+    // if the privilege wasn't granted
+    const bool enabled = ::LookupPrivilegeValueW(nullptr, L"SeLockMemoryPrivilege", &privileges.Privileges[0].Luid)
+        && ::AdjustTokenPrivileges(token, FALSE, &privileges, 0, nullptr, nullptr)
+        && ::GetLastError() == ERROR_SUCCESS;
+
+    ::CloseHandle(token);
+    return enabled;
+}
+
+
+namespace Details
+{
+
+//------------------------------------------------------------------------------
+// Allocations of at least this many bytes are served with large pages
+// by LargePageAllocator (the large page size, or 2 MB if unsupported)
+//------------------------------------------------------------------------------
+inline [[nodiscard]] size_t LargePageAllocationThreshold() noexcept
+{
+    static const size_t threshold = (std::max)(::GetLargePageMinimum(), size_t{ 2 * 1024 * 1024 });
+    return threshold;
+}
+
+} // namespace Details
+
+
+//------------------------------------------------------------------------------
+// Allocator that serves large allocations (from the large page size up)
+// directly from the OS, with large pages when available: the memory is
+// committed and locked at allocation, with no page faults on first touch
+// and fewer TLB misses. Falls back to regular pages if large pages can't
+// be allocated (see EnableLargePages()); small allocations use operator new.
+//------------------------------------------------------------------------------
+template <typename T>
+class LargePageAllocator
+{
+public:
+    using value_type = T;
+
+    LargePageAllocator() noexcept = default;
+
+    template <typename U>
+    LargePageAllocator(const LargePageAllocator<U>&) noexcept
+    {
+    }
+
+    [[nodiscard]] T* allocate(size_t count)
+    {
+        if (count > (std::numeric_limits<size_t>::max)() / sizeof(T))
+        {
+            throw std::bad_alloc();
+        }
+
+        size_t bytes = count * sizeof(T);
+        if (bytes < Details::LargePageAllocationThreshold())
+        {
+            return static_cast<T*>(::operator new(bytes));
+        }
+
+        bool usedLargePages = false;
+        return static_cast<T*>(Details::AllocatePages(bytes, true, usedLargePages));
+    }
+
+    void deallocate(T* p, size_t count) noexcept
+    {
+        if (count * sizeof(T) < Details::LargePageAllocationThreshold())
+        {
+            ::operator delete(p);
+        }
+        else
+        {
+            Details::FreePages(p);
+        }
+    }
+
+    template <typename U>
+    [[nodiscard]] bool operator==(const LargePageAllocator<U>&) const noexcept
+    {
+        return true;
+    }
+
+    template <typename U>
+    [[nodiscard]] bool operator!=(const LargePageAllocator<U>&) const noexcept
+    {
+        return false;
+    }
+};
+
+
+// UTF-8 and UTF-16 strings backed by large pages when large enough
+using LargePageUtf8String = std::basic_string<char, std::char_traits<char>, LargePageAllocator<char>>;
+using LargePageUtf16String = std::basic_string<wchar_t, std::char_traits<wchar_t>, LargePageAllocator<wchar_t>>;
+
+
+//------------------------------------------------------------------------------
+// Convert from UTF-16 to UTF-8, to a string backed by large pages
+// (opt-in path for large outputs: see LargePageAllocator).
+// Signal errors throwing UnicodeConversionException.
+//------------------------------------------------------------------------------
+inline [[nodiscard]] LargePageUtf8String ToUtf8LargePages(std::wstring_view utf16)
+{
+    LargePageUtf8String utf8(Details::Utf8LengthOfUtf16(utf16.data(), utf16.length()), ' ');
+    Details::TranscodeUtf16ToUtf8With(Details::PickUtf16ToUtf8Kernel(utf16.data(), utf16.length()),
+        utf16.data(), utf16.length(), utf8.data(), Details::UseStreamingStores(utf16.length() * sizeof(wchar_t)));
+    return utf8;
+}
+
+
+//------------------------------------------------------------------------------
+// Convert from UTF-8 to UTF-16, to a string backed by large pages
+// (opt-in path for large outputs: see LargePageAllocator).
+// Signal errors throwing UnicodeConversionException.
+//------------------------------------------------------------------------------
+inline [[nodiscard]] LargePageUtf16String ToUtf16LargePages(std::string_view utf8)
+{
+    LargePageUtf16String utf16(Details::Utf16LengthOfUtf8(utf8.data(), utf8.length()), L' ');
+    Details::TranscodeUtf8ToUtf16With(Details::PickUtf8ToUtf16Kernel(utf8.data(), utf8.length()),
+        utf8.data(), utf8.length(), utf16.data(), Details::UseStreamingStores(utf8.length()));
+    return utf16;
+}
+
+
+
+//==============================================================================
+//              Line ending normalization fused into the conversions
+//==============================================================================
+
+//------------------------------------------------------------------------------
+// How the conversions with line ending normalization treat line endings.
+// Lone CRs are kept as they are by every policy.
+//------------------------------------------------------------------------------
+enum class LineEndingPolicy
+{
+    Preserve,   // Keep the line endings as they are
+    CrLfToLf,   // Replace CR LF with LF (e.g. from Windows text files to Unix)
+    LfToCrLf,   // Replace the LFs not preceded by CR with CR LF
+};
+
+
+namespace Details
+{
+
+// Block size of the string-returning conversions with line ending normalization
+inline constexpr size_t kLineEndingBlockLength = 64 * 1024;
+
+
+//------------------------------------------------------------------------------
+// Offset of the first occurrence of the given ASCII char in the text,
+// scanned 16 code units at a time, or length if not found
+//------------------------------------------------------------------------------
+inline [[nodiscard]] size_t FindAsciiChar(const char* src, size_t length, char ch) noexcept
+{
+    size_t i = 0;
+
+#ifdef UNICODECONVSTD_SSE2
+    const __m128i target = _mm_set1_epi8(ch);
+    for (; length - i >= 16; i += 16)
+    {
+        const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        const unsigned int mask = static_cast<unsigned int>(
+            _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, target)));
+        if (mask != 0)
+        {
+            return i + LowestSetBit(mask);
+        }
+    }
+#endif
+
+    while (i < length && src[i] != ch)
+    {
+        ++i;
+    }
+    return i;
+}
+
+inline [[nodiscard]] size_t FindAsciiChar(const wchar_t* src, size_t length, char ch) noexcept
+{
+    size_t i = 0;
+
+#ifdef UNICODECONVSTD_SSE2
+    const __m128i target = _mm_set1_epi16(ch);
+    for (; length - i >= 16; i += 16)
+    {
+        const __m128i units0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        const __m128i units1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i + 8));
+        const unsigned int mask = static_cast<unsigned int>(_mm_movemask_epi8(_mm_packs_epi16(
+            _mm_cmpeq_epi16(units0, target), _mm_cmpeq_epi16(units1, target))));
+        if (mask != 0)
+        {
+            return i + LowestSetBit(mask);
+        }
+    }
+#endif
+
+    while (i < length && src[i] != static_cast<wchar_t>(ch))
+    {
+        ++i;
+    }
+    return i;
+}
+
+
+//------------------------------------------------------------------------------
+// Convert a block of length code units (UTF-16 to UTF-8, or UTF-8 to UTF-16)
+// with the given kernel, normalizing the line endings per policy.
+// dest must have room for 3 * length + 1 UTF-8 chars, or 2 * length + 1
+// UTF-16 code units. Returns the number of code units written.
+//
+// The text between line endings goes through the conversion kernel; the CRs
+// (CrLfToLf) or LFs (LfToCrLf) are found with SIMD scans. A CR LF pair can
+// straddle two blocks: crCarry, false before the first block, is set when
+// the block ends with a CR. With CrLfToLf, that CR is held back until the next
+// block (or lastBlock) shows whether an LF follows it; with LfToCrLf, it tells
+// that an LF at the beginning of the next block already follows a CR.
+//------------------------------------------------------------------------------
+template <typename SourceChar, typename DestChar>
+inline size_t NormalizeLineEndingsBlock(const SourceChar* src, size_t length, DestChar* dest,
+    LineEndingPolicy policy, ConversionKernel kernel, bool& crCarry, bool lastBlock)
+{
+    const auto transcode = [kernel](const SourceChar* text, size_t textLength, DestChar* output)
+    {
+        if constexpr (std::is_same_v<SourceChar, wchar_t>)
+        {
+            return TranscodeUtf16ToUtf8With(kernel, text, textLength, output);
+        }
+        else
+        {
+            return TranscodeUtf8ToUtf16With(kernel, text, textLength, output);
+        }
+    };
+
+    const SourceChar* const end = src + length;
+    DestChar* const destBegin = dest;
+
+    if (policy == LineEndingPolicy::CrLfToLf)
+    {
+        // The CR held back from the previous block is dropped if an LF follows
+        if (crCarry && (src != end || lastBlock))
+        {
+            if (src == end || *src != '\n')
+            {
+                *dest++ = '\r';
+            }
+            crCarry = false;
+        }
+
+        while (src != end)
+        {
+            const size_t runLength = FindAsciiChar(src, static_cast<size_t>(end - src), '\r');
+            dest += transcode(src, runLength, dest);
+            src += runLength;
+            if (src == end)
+            {
+                break;
+            }
+
+            // Skip the CR, and write it back unless an LF follows it
+            ++src;
+            if (src == end)
+            {
+                if (lastBlock)
+                {
+                    *dest++ = '\r';
+                }
+                else
+                {
+                    crCarry = true;
+                }
+                break;
+            }
+            if (*src != '\n')
+            {
+                *dest++ = '\r';
+            }
+        }
+    }
+    else if (policy == LineEndingPolicy::LfToCrLf)
+    {
+        bool afterCr = crCarry;
+        while (src != end)
+        {
+            const size_t runLength = FindAsciiChar(src, static_cast<size_t>(end - src), '\n');
+            dest += transcode(src, runLength, dest);
+            if (runLength != 0)
+            {
+                afterCr = (src[runLength - 1] == '\r');
+            }
+            src += runLength;
+            if (src == end)
+            {
+                break;
+            }
+
+            if (!afterCr)
+            {
+                *dest++ = '\r';
+            }
+            *dest++ = '\n';
+            ++src;
+            afterCr = false;
+        }
+        crCarry = afterCr;
+    }
+    else
+    {
+        dest += transcode(src, length, dest);
+    }
+
+    return static_cast<size_t>(dest - destBegin);
+}
+
+} // namespace Details
+
+
+//------------------------------------------------------------------------------
+// Convert from UTF-16 to UTF-8, normalizing the line endings per policy
+// in the same pass (e.g. CR LF to LF when reading Windows text files).
+// Signal errors throwing UnicodeConversionException.
+//------------------------------------------------------------------------------
+inline [[nodiscard]] std::string ToUtf8(std::wstring_view utf16, LineEndingPolicy policy)
+{
+    // Special case of empty input string
+    if (utf16.empty())
+    {
+        return std::string{};
+    }
+
+    const ConversionKernel kernel = Details::PickUtf16ToUtf8Kernel(utf16.data(), utf16.length());
+
+    // Convert in blocks, to size the output close to its final length
+    std::string utf8;
+    size_t utf8Length = 0;
+    bool crCarry = false;
+
+    const wchar_t* src = utf16.data();
+    size_t remaining = utf16.length();
+    while (remaining != 0)
+    {
+        const size_t blockLength = Details::Utf16BlockLength(src, remaining, Details::kLineEndingBlockLength);
+        Details::EnsureRoom(utf8, utf8Length, 3 * blockLength + 1);
+        utf8Length += Details::NormalizeLineEndingsBlock(src, blockLength, utf8.data() + utf8Length,
+            policy, kernel, crCarry, blockLength == remaining);
+        src += blockLength;
+        remaining -= blockLength;
+    }
+
+    utf8.resize(utf8Length);
+    return utf8;
+}
+
+
+//------------------------------------------------------------------------------
+// Convert from UTF-8 to UTF-16, normalizing the line endings per policy
+// in the same pass (e.g. LF to CR LF for a Windows edit control).
+// Signal errors throwing UnicodeConversionException.
+//------------------------------------------------------------------------------
+inline [[nodiscard]] std::wstring ToUtf16(std::string_view utf8, LineEndingPolicy policy)
+{
+    // Special case of empty input string
+    if (utf8.empty())
+    {
+        return std::wstring{};
+    }
+
+    const ConversionKernel kernel = Details::PickUtf8ToUtf16Kernel(utf8.data(), utf8.length());
+
+    std::wstring utf16;
+    size_t utf16Length = 0;
+    bool crCarry = false;
+
+    const char* src = utf8.data();
+    size_t remaining = utf8.length();
+    while (remaining != 0)
+    {
+        const size_t blockLength = Details::Utf8BlockLength(src, remaining, Details::kLineEndingBlockLength);
+        Details::EnsureRoom(utf16, utf16Length, 2 * blockLength + 1);
+        utf16Length += Details::NormalizeLineEndingsBlock(src, blockLength, utf16.data() + utf16Length,
+            policy, kernel, crCarry, blockLength == remaining);
+        src += blockLength;
+        remaining -= blockLength;
+    }
+
+    utf16.resize(utf16Length);
+    return utf16;
+}
+
+
+//------------------------------------------------------------------------------
+// Convert from UTF-16 to UTF-8, normalizing the line endings per policy,
+// and sending the output to sink in blocks: see the sink-based ToUtf8().
+// A CR LF pair split across the internal blocks is still recognized.
+//------------------------------------------------------------------------------
+template <typename Sink>
+inline void ToUtf8(std::wstring_view utf16, LineEndingPolicy policy, Sink& sink)
+{
+    if (utf16.empty())
+    {
+        return;
+    }
+
+    constexpr size_t kBufferLength = Details::kSinkBlockBytes;
+    constexpr size_t kMinBlockUnits = 256;
+
+    char buffer[kBufferLength];
+    size_t bufferUsed = 0;
+
+    const ConversionKernel kernel = Details::PickUtf16ToUtf8Kernel(utf16.data(), utf16.length());
+    bool crCarry = false;
+
+    const wchar_t* src = utf16.data();
+    size_t remaining = utf16.length();
+    while (remaining != 0)
+    {
+        // Each code unit takes at most 3 UTF-8 chars, plus a held back CR
+        size_t room = kBufferLength - bufferUsed;
+        if (room < 3 * kMinBlockUnits + 1)
+        {
+            sink.write(static_cast<const char*>(buffer), bufferUsed);
+            bufferUsed = 0;
+            room = kBufferLength;
+        }
+
+        const size_t blockLength = Details::Utf16BlockLength(src, remaining, (room - 1) / 3);
+        bufferUsed += Details::NormalizeLineEndingsBlock(src, blockLength, buffer + bufferUsed,
+            policy, kernel, crCarry, blockLength == remaining);
+        src += blockLength;
+        remaining -= blockLength;
+    }
+
+    if (bufferUsed != 0)
+    {
+        sink.write(static_cast<const char*>(buffer), bufferUsed);
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// Convert from UTF-8 to UTF-16, normalizing the line endings per policy,
+// and sending the output to sink in blocks: see the sink-based ToUtf16().
+// A CR LF pair split across the internal blocks is still recognized.
+//------------------------------------------------------------------------------
+template <typename Sink>
+inline void ToUtf16(std::string_view utf8, LineEndingPolicy policy, Sink& sink)
+{
+    if (utf8.empty())
+    {
+        return;
+    }
+
+    constexpr size_t kBufferLength = Details::kSinkBlockBytes / sizeof(wchar_t);
+    constexpr size_t kMinBlockChars = 256;
+
+    wchar_t buffer[kBufferLength];
+    size_t bufferUsed = 0;
+
+    const ConversionKernel kernel = Details::PickUtf8ToUtf16Kernel(utf8.data(), utf8.length());
+    bool crCarry = false;
+
+    const char* src = utf8.data();
+    size_t remaining = utf8.length();
+    while (remaining != 0)
+    {
+        // Each char produces at most 2 UTF-16 code units (LF to CR LF),
+        // plus a held back CR
+        size_t room = kBufferLength - bufferUsed;
+        if (room < 2 * kMinBlockChars + 1)
+        {
+            sink.write(static_cast<const wchar_t*>(buffer), bufferUsed);
+            bufferUsed = 0;
+            room = kBufferLength;
+        }
+
+        const size_t blockLength = Details::Utf8BlockLength(src, remaining, (room - 1) / 2);
+        bufferUsed += Details::NormalizeLineEndingsBlock(src, blockLength, buffer + bufferUsed,
+            policy, kernel, crCarry, blockLength == remaining);
+        src += blockLength;
+        remaining -= blockLength;
+    }
+
+    if (bufferUsed != 0)
+    {
+        sink.write(static_cast<const wchar_t*>(buffer), bufferUsed);
+    }
+}
+
+
+
+//==============================================================================
+//                  Conversion with a line offset index
+//==============================================================================
+
+//------------------------------------------------------------------------------
+// Result of ToUtf8WithLineIndex: the converted string, and the offsets
+// in it where each line starts
+//------------------------------------------------------------------------------
+struct Utf8WithLineIndex
+{
+    std::string utf8;
+    std::vector<size_t> lineOffsets;
+};
+
+
+//------------------------------------------------------------------------------
+// Convert from UTF-16 to UTF-8, also returning the UTF-8 offset of the first
+// char of each line, so the converted text is ready for random access by line:
+// line i spans [lineOffsets[i], lineOffsets[i + 1]), or up to the end of the
+// string for the last line, including its line ending (LF or CR LF).
+// Single pass: the LFs are found by the kernel's SIMD scan of the ASCII runs,
+// which stops at them as it stops at non-ASCII chars.
+// A final LF doesn't start a new line; empty input has no lines.
+// Signal errors throwing UnicodeConversionException.
+//------------------------------------------------------------------------------
+inline [[nodiscard]] Utf8WithLineIndex ToUtf8WithLineIndex(std::wstring_view utf16)
+{
+    Utf8WithLineIndex result;
+    if (utf16.empty())
+    {
+        return result;
+    }
+
+    const ConversionKernel kernel = Details::PickUtf16ToUtf8Kernel(utf16.data(), utf16.length());
+
+    // Convert in blocks, to size the output close to its final length
+    size_t utf8Length = 0;
+    result.lineOffsets.push_back(0);
+
+    const wchar_t* src = utf16.data();
+    size_t remaining = utf16.length();
+    while (remaining != 0)
+    {
+        const size_t blockLength = Details::Utf16BlockLength(src, remaining, Details::kLineEndingBlockLength);
+        Details::EnsureRoom(result.utf8, utf8Length, 3 * blockLength);
+        utf8Length += Details::TranscodeUtf16ToUtf8IndexingLines(kernel, src, blockLength,
+            result.utf8.data() + utf8Length, utf8Length, result.lineOffsets);
+        src += blockLength;
+        remaining -= blockLength;
+    }
+
+    // A final LF ends the last line, rather than starting a new one
+    if (result.lineOffsets.back() == utf8Length)
+    {
+        result.lineOffsets.pop_back();
+    }
+
+    result.utf8.resize(utf8Length);
+    return result;
+}
+
+} // namespace UnicodeConvStd
+
+
+#if _MSVC_LANG >= 202002L
+// The views don't own the text they refer to
+template <typename SourceChar, typename ValueType>
+inline constexpr bool std::ranges::enable_borrowed_range<
+    UnicodeConvStd::Details::DecodingView<SourceChar, ValueType>> = true;
+
+template <typename SourceChar, typename ValueType>
+inline constexpr bool std::ranges::enable_view<
+    UnicodeConvStd::Details::DecodingView<SourceChar, ValueType>> = true;
+#endif
 
 
 #endif // GIOVANNI_DICANIO_UNICODECONVSTD_HPP_INCLUDED
@@ -0,0 +1,1637 @@
+////////////////////////////////////////////////////////////////////////////////
+// BenchmarkUnicodeConvStd.cpp : Benchmark the Unicode conversion functions
+// by Giovanni Dicanio <giovanni.dicanio AT gmail.com>
+//
+// Build in Release mode, and run from the command line.
+////////////////////////////////////////////////////////////////////////////////
+
+
+// The comparative benchmark measures the deprecated std::codecvt_utf8_utf16,
+// and the CRT wcstombs and mbstowcs
+#define _SILENCE_CXX17_CODECVT_HEADER_DEPRECATION_WARNING
+#define _CRT_SECURE_NO_WARNINGS
+
+#include "../UnicodeConvStd/UnicodeConvStd.hpp"     // Module to benchmark
+
+#include <intrin.h>             // __rdtsc, _mm_lfence
+#include <psapi.h>              // GetProcessMemoryInfo
+
+#include <algorithm>            // std::sort, std::shuffle
+#include <atomic>               // std::atomic
+#include <chrono>               // std::chrono::steady_clock
+#include <clocale>              // std::setlocale
+#include <codecvt>              // std::codecvt_utf8_utf16
+#include <cstdint>              // std::uint64_t
+#include <cstdio>               // std::printf
+#include <cstdlib>              // std::strtoull, std::wcstombs, std::mbstowcs
+#include <locale>               // std::wstring_convert
+#include <new>                  // std::bad_alloc
+#include <optional>             // std::optional
+#include <random>               // std::mt19937
+#include <stdexcept>            // std::range_error
+#include <string>               // std::string, std::wstring
+#include <thread>               // std::thread
+#include <vector>               // std::vector
+
+// iconv isn't part of the Windows SDK: it's compared when available (e.g. from vcpkg)
+#if __has_include(<iconv.h>)
+#include <iconv.h>
+#define UNICODECONVSTD_BENCHMARK_ICONV
+#endif
+
+
+//
+// Allocation counting: the global operator new is replaced to count the
+// allocations of each conversion method in the comparative benchmark.
+// Only the measured calls count, on their own thread: the timing code isn't
+// charged to them, and the other benchmarks (e.g. the scaling one, that
+// measures the allocator contention) don't contend for a shared counter.
+//
+
+thread_local size_t t_allocationCount = 0;
+thread_local bool t_countAllocations = false;
+
+void* operator new(size_t size)
+{
+    if (t_countAllocations)
+    {
+        ++t_allocationCount;
+    }
+    if (void* p = std::malloc(size != 0 ? size : 1))
+    {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+    std::free(p);
+}
+
+// Count the allocations of the current thread during its lifetime
+struct AllocationCountingScope
+{
+    AllocationCountingScope() noexcept
+    {
+        t_countAllocations = true;
+    }
+
+    ~AllocationCountingScope()
+    {
+        t_countAllocations = false;
+    }
+};
+
+
+//
+// Test corpora
+//
+
+// Plain ASCII text
+std::wstring MakeAsciiCorpus(size_t length)
+{
+    const std::wstring text = L"The quick brown fox jumps over the lazy dog. ";
+
+    std::wstring corpus;
+    while (corpus.length() < length)
+    {
+        corpus += text;
+    }
+    corpus.resize(length);
+    return corpus;
+}
+
+
+// Chat messages: short ASCII text, mixed with emoji
+// (U+1F600 grinning face, U+1F44D thumbs up, U+2764 heart, U+1F389 party popper)
+std::wstring MakeEmojiChatCorpus(size_t length)
+{
+    const std::wstring messages[] = {
+        L"ok \xD83D\xDC4D\xD83D\xDC4D ",
+        L"see you soon \xD83D\xDE00\xD83D\xDE00\xD83D\xDE00 ",
+        L"love it \x2764 \xD83C\xDF89\xD83C\xDF89\xD83C\xDF89\xD83C\xDF89 ",
+        L"lol \xD83D\xDE02\xD83D\xDE02\xD83D\xDE02\xD83D\xDE02\xD83D\xDE02 "
+    };
+
+    std::wstring corpus;
+    for (size_t i = 0; corpus.length() < length; ++i)
+    {
+        corpus += messages[i % 4];
+    }
+
+    // Don't split the last surrogate pair
+    corpus.resize(length);
+    if (!corpus.empty() && corpus.back() >= 0xD800 && corpus.back() <= 0xDBFF)
+    {
+        corpus.back() = L' ';
+    }
+    return corpus;
+}
+
+
+// Emoji only: all the code points are surrogate pairs
+std::wstring MakeEmojiOnlyCorpus(size_t length)
+{
+    std::wstring corpus;
+    for (unsigned int i = 0; corpus.length() + 2 <= length; ++i)
+    {
+        // Emoji from the U+1F300 - U+1F64F blocks
+        const unsigned int offset = 0x1F300 + (i * 7) % 0x350 - 0x10000;
+        corpus += static_cast<wchar_t>(0xD800 + (offset >> 10));
+        corpus += static_cast<wchar_t>(0xDC00 + (offset & 0x3FF));
+    }
+    return corpus;
+}
+
+
+// CJK text: Japanese and Chinese sentences, with all the code points
+// taking 3 chars in UTF-8
+std::wstring MakeCjkCorpus(size_t length)
+{
+    const std::wstring sentences[] = {
+        L"\x79C1\x306F\x65E5\x672C\x8A9E\x3092\x52C9\x5F37\x3057\x3066\x3044\x307E\x3059\x3002",
+        L"\x6211\x4EEC\x5B66\x4E60\x4E2D\x6587\x3002",
+        L"\x4ECA\x65E5\x306F\x3044\x3044\x5929\x6C17\x3067\x3059\x306D\x3002"
+    };
+
+    std::wstring corpus;
+    for (size_t i = 0; corpus.length() < length; ++i)
+    {
+        corpus += sentences[i % 3];
+    }
+    corpus.resize(length);
+    return corpus;
+}
+
+
+// Cyrillic text: short words, with 2 chars per code point in UTF-8
+std::wstring MakeCyrillicCorpus(size_t length)
+{
+    const std::wstring words[] = {
+        L"\x041F\x0440\x0438\x0432\x0435\x0442 ",
+        L"\x043C\x0438\x0440, ",
+        L"\x043A\x0430\x043A \x0434\x0435\x043B\x0430? "
+    };
+
+    std::wstring corpus;
+    for (size_t i = 0; corpus.length() < length; ++i)
+    {
+        corpus += words[i % 3];
+    }
+    corpus.resize(length);
+    return corpus;
+}
+
+
+// Latin text: Western European words, with the accented letters
+// taking 2 chars in UTF-8
+std::wstring MakeLatinCorpus(size_t length)
+{
+    const std::wstring words[] = {
+        L"caf\x00E9 ",
+        L"cr\x00E8me br\x00FBl\x00E9" L"e, ",
+        L"Stra\x00DF" L"e ",
+        L"se\x00F1or, ",
+        L"\x00E0 bient\x00F4t. "
+    };
+
+    std::wstring corpus;
+    for (size_t i = 0; corpus.length() < length; ++i)
+    {
+        corpus += words[i % 5];
+    }
+    corpus.resize(length);
+    return corpus;
+}
+
+
+// Mixed text: ASCII, Latin, Cyrillic, CJK and emoji in the same text
+std::wstring MakeMixedCorpus(size_t length)
+{
+    const std::wstring pieces[] = {
+        L"Status: ok. ",
+        L"caf\x00E9 cr\x00E8me, ",
+        L"\x041F\x0440\x0438\x0432\x0435\x0442 ",
+        L"\x65E5\x672C\x8A9E\x3002",
+        L"\xD83D\xDE00 "
+    };
+
+    std::wstring corpus;
+    for (size_t i = 0; corpus.length() < length; ++i)
+    {
+        corpus += pieces[i % 5];
+    }
+
+    // Don't split the last surrogate pair
+    corpus.resize(length);
+    if (!corpus.empty() && corpus.back() >= 0xD800 && corpus.back() <= 0xDBFF)
+    {
+        corpus.back() = L' ';
+    }
+    return corpus;
+}
+
+
+//
+// Benchmark helpers
+//
+
+// Sink that appends the converted text to a string
+template <typename StringType>
+struct StringSink
+{
+    StringType& output;
+
+    void write(const typename StringType::value_type* data, size_t length)
+    {
+        output.append(data, length);
+    }
+};
+
+
+// Hardware performance counters of the calling thread; the counters that
+// can't be read are empty.
+// Windows exposes only the thread cycle count to user mode, with
+// QueryThreadCycleTime (usually at the fixed rate of the time stamp counter,
+// not at the actual core clock). Instructions, branch misses and cache
+// misses need a kernel driver, or ETW PMC sampling with administrator rights.
+struct CounterValues
+{
+    std::optional<std::uint64_t> cycles;
+    std::optional<std::uint64_t> instructions;
+    std::optional<std::uint64_t> branchMisses;
+    std::optional<std::uint64_t> l1Misses;
+    std::optional<std::uint64_t> llcMisses;
+};
+
+
+CounterValues ReadCounters()
+{
+    CounterValues values;
+
+    ULONG64 cycles = 0;
+    if (::QueryThreadCycleTime(::GetCurrentThread(), &cycles))
+    {
+        values.cycles = cycles;
+    }
+    return values;
+}
+
+
+// Counter increments from start to end (the counters available at both reads)
+CounterValues CounterDelta(const CounterValues& start, const CounterValues& end)
+{
+    const auto delta = [](const std::optional<std::uint64_t>& from, const std::optional<std::uint64_t>& to)
+    {
+        return (from && to) ? std::optional<std::uint64_t>(*to - *from) : std::nullopt;
+    };
+
+    return CounterValues{
+        delta(start.cycles, end.cycles),
+        delta(start.instructions, end.instructions),
+        delta(start.branchMisses, end.branchMisses),
+        delta(start.l1Misses, end.l1Misses),
+        delta(start.llcMisses, end.llcMisses)
+    };
+}
+
+
+// Run the given function repeatedly for at least the minimum time,
+// and print the throughput in GB/s of input processed, and the thread
+// cycles per byte if available.
+// Returns the number of calls, including the warm-up one.
+template <typename Function>
+size_t Measure(const char* corpusName, const char* caseName, size_t inputBytes, Function function)
+{
+    using Clock = std::chrono::steady_clock;
+    constexpr auto kMinDuration = std::chrono::milliseconds(500);
+
+    // Warm up
+    function();
+
+    size_t iterations = 0;
+    const CounterValues startCounters = ReadCounters();
+    const auto start = Clock::now();
+    auto elapsed = Clock::duration::zero();
+    do
+    {
+        function();
+        ++iterations;
+        elapsed = Clock::now() - start;
+    } while (elapsed < kMinDuration);
+    const CounterValues counters = CounterDelta(startCounters, ReadCounters());
+
+    const double seconds = std::chrono::duration<double>(elapsed).count();
+    const double bytes = static_cast<double>(inputBytes) * iterations;
+    std::printf("%-12s %-36s %8.3f GB/s", corpusName, caseName, bytes / seconds / 1e9);
+    if (counters.cycles)
+    {
+        std::printf(" %8.3f cycles/B", static_cast<double>(*counters.cycles) / bytes);
+    }
+    std::printf("\n");
+    return iterations + 1;
+}
+
+
+// Reset the kernel selection counters, if the telemetry is compiled in
+// (the counters are shared by all the threads, so the benchmarks normally
+// run without them)
+void ResetSelectedKernel()
+{
+#ifdef UNICODECONVSTD_KERNEL_TELEMETRY
+    UnicodeConvStd::ResetKernelSelectionCounts();
+#endif
+}
+
+
+// Print the kernel the portable engine picked for most of the blocks
+// since the last reset of the counters, if the telemetry is compiled in
+void PrintSelectedKernel()
+{
+#ifdef UNICODECONVSTD_KERNEL_TELEMETRY
+    using UnicodeConvStd::ConversionKernel;
+
+    const struct
+    {
+        ConversionKernel kernel;
+        const char* name;
+    } kernels[] = {
+        { ConversionKernel::Ascii, "Ascii" },
+        { ConversionKernel::Generic, "Generic" },
+        { ConversionKernel::ThreeByte, "ThreeByte" },
+        { ConversionKernel::Supplementary, "Supplementary" }
+    };
+
+    const char* selectedName = kernels[0].name;
+    std::uint64_t selectedCount = 0;
+    for (const auto& entry : kernels)
+    {
+        const std::uint64_t count = UnicodeConvStd::KernelSelectionCount(entry.kernel);
+        if (count > selectedCount)
+        {
+            selectedName = entry.name;
+            selectedCount = count;
+        }
+    }
+    std::printf("%-12s   (kernel: %s)\n", "", selectedName);
+#endif
+}
+
+
+// Run the given function repeatedly for at least the minimum time,
+// and print the average latency in ns per call
+template <typename Function>
+void MeasureLatency(const char* caseName, Function function)
+{
+    using Clock = std::chrono::steady_clock;
+    constexpr auto kMinDuration = std::chrono::milliseconds(500);
+    constexpr size_t kCallsPerCheck = 1000;
+
+    // Warm up
+    function();
+
+    size_t calls = 0;
+    const auto start = Clock::now();
+    auto elapsed = Clock::duration::zero();
+    do
+    {
+        // Don't let the clock reads dominate the timing of short calls
+        for (size_t i = 0; i < kCallsPerCheck; ++i)
+        {
+            function();
+        }
+        calls += kCallsPerCheck;
+        elapsed = Clock::now() - start;
+    } while (elapsed < kMinDuration);
+
+    const double nanoseconds = std::chrono::duration<double, std::nano>(elapsed).count();
+    std::printf("%-49s %8.1f ns/call\n", caseName, nanoseconds / calls);
+}
+
+
+// Convert from UTF-16 to UTF-8 with the two Win32 API calls only (measure,
+// then convert): the baseline for the short string fast path
+std::string Win32ToUtf8(const std::wstring& utf16)
+{
+    const int utf16Length = static_cast<int>(utf16.length());
+    const int utf8Length = ::WideCharToMultiByte(CP_UTF8, WC_ERR_INVALID_CHARS,
+        utf16.data(), utf16Length, nullptr, 0, nullptr, nullptr);
+    std::string utf8(utf8Length, ' ');
+    ::WideCharToMultiByte(CP_UTF8, WC_ERR_INVALID_CHARS,
+        utf16.data(), utf16Length, utf8.data(), utf8Length, nullptr, nullptr);
+    return utf8;
+}
+
+
+// Convert from UTF-8 to UTF-16 with the two Win32 API calls only (measure,
+// then convert): the baseline for the short string fast path
+std::wstring Win32ToUtf16(const std::string& utf8)
+{
+    const int utf8Length = static_cast<int>(utf8.length());
+    const int utf16Length = ::MultiByteToWideChar(CP_UTF8, MB_ERR_INVALID_CHARS,
+        utf8.data(), utf8Length, nullptr, 0);
+    std::wstring utf16(utf16Length, L' ');
+    ::MultiByteToWideChar(CP_UTF8, MB_ERR_INVALID_CHARS,
+        utf8.data(), utf8Length, utf16.data(), utf16Length);
+    return utf16;
+}
+
+
+// Benchmark the per-call latency of short string conversions
+void BenchmarkShortStrings()
+{
+    const struct
+    {
+        const char* name;
+        std::wstring utf16;
+    } strings[] = {
+        { "ASCII (8)", L"user_id:" },
+        { "ASCII (15)", L"Content-Length:" },
+        { "Latin (12)", L"caf\x00E9 cr\x00E8me" },
+        { "CJK (6)", L"\x65E5\x672C\x8A9E\x30C6\x30AD\x30B9" }
+    };
+
+    char caseName[64];
+    for (const auto& entry : strings)
+    {
+        const std::string utf8 = UnicodeConvStd::ToUtf8(entry.utf16);
+        std::string utf8Output;
+        std::wstring utf16Output;
+
+        std::snprintf(caseName, sizeof(caseName), "%-12s ToUtf8 (Win32 API calls)", entry.name);
+        MeasureLatency(caseName, [&]() { utf8Output = Win32ToUtf8(entry.utf16); });
+
+        std::snprintf(caseName, sizeof(caseName), "%-12s ToUtf8", entry.name);
+        MeasureLatency(caseName, [&]() { utf8Output = UnicodeConvStd::ToUtf8(entry.utf16); });
+
+        std::snprintf(caseName, sizeof(caseName), "%-12s ToUtf16 (Win32 API calls)", entry.name);
+        MeasureLatency(caseName, [&]() { utf16Output = Win32ToUtf16(utf8); });
+
+        std::snprintf(caseName, sizeof(caseName), "%-12s ToUtf16", entry.name);
+        MeasureLatency(caseName, [&]() { utf16Output = UnicodeConvStd::ToUtf16(utf8); });
+    }
+}
+
+
+// Benchmark large conversions to a contiguous string, and to segmented output
+void BenchmarkLargeOutput(const char* corpusName, const std::wstring& utf16)
+{
+    const size_t inputBytes = utf16.length() * sizeof(wchar_t);
+
+    Measure(corpusName, "ToUtf8 (Win32, contiguous)", inputBytes, [&]()
+    {
+        const std::string utf8 = UnicodeConvStd::ToUtf8(utf16);
+    });
+
+    Measure(corpusName, "ToUtf8 to sink (growing string)", inputBytes, [&]()
+    {
+        std::string utf8;
+        StringSink<std::string> sink{ utf8 };
+        UnicodeConvStd::ToUtf8(utf16, sink);
+    });
+
+    Measure(corpusName, "ToUtf8Segmented (1 MB blocks)", inputBytes, [&]()
+    {
+        const UnicodeConvStd::SegmentedUtf8 utf8 = UnicodeConvStd::ToUtf8Segmented(utf16);
+    });
+
+    UnicodeConvStd::SegmentedOutputOptions largePages;
+    largePages.useLargePages = true;
+    bool usedLargePages = false;
+    Measure(corpusName, "ToUtf8Segmented (large pages)", inputBytes, [&]()
+    {
+        const UnicodeConvStd::SegmentedUtf8 utf8 = UnicodeConvStd::ToUtf8Segmented(utf16, largePages);
+        usedLargePages = utf8.UsesLargePages();
+    });
+    if (!usedLargePages)
+    {
+        std::printf("%-12s   (large pages not available: regular pages used)\n", "");
+    }
+}
+
+
+// Benchmark large conversions with cached and non-temporal output stores,
+// while another thread repeatedly reads a cache-resident working set:
+// the non-temporal stores should leave more of the cache to the co-runner
+void BenchmarkCoRunningWorkload(const char* corpusName, const std::wstring& utf16)
+{
+    using Clock = std::chrono::steady_clock;
+    constexpr size_t kWorkingSetBytes = 4 * 1024 * 1024;
+
+    const struct
+    {
+        UnicodeConvStd::OutputStoreMode storeMode;
+        const char* caseName;
+    } cases[] = {
+        { UnicodeConvStd::OutputStoreMode::Cached, "ToUtf8Segmented (cached stores)" },
+        { UnicodeConvStd::OutputStoreMode::NonTemporal, "ToUtf8Segmented (non-temporal)" }
+    };
+
+    const std::vector<std::uint64_t> workingSet(kWorkingSetBytes / sizeof(std::uint64_t), 1);
+    for (const auto& entry : cases)
+    {
+        UnicodeConvStd::SegmentedOutputOptions options;
+        options.storeMode = entry.storeMode;
+
+        // The co-running workload: sum the working set until stopped
+        std::atomic<bool> stop{ false };
+        size_t passes = 0;
+        std::uint64_t sum = 0;
+        std::thread coRunner([&]()
+        {
+            while (!stop.load(std::memory_order_relaxed))
+            {
+                for (const std::uint64_t value : workingSet)
+                {
+                    sum += value;
+                }
+                ++passes;
+            }
+        });
+
+        const auto start = Clock::now();
+        Measure(corpusName, entry.caseName, utf16.length() * sizeof(wchar_t), [&]()
+        {
+            const UnicodeConvStd::SegmentedUtf8 utf8 = UnicodeConvStd::ToUtf8Segmented(utf16, options);
+        });
+        stop = true;
+        coRunner.join();
+
+        const double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        std::printf("%-12s   (co-running workload: %.3f GB/s, checksum %llu)\n", "",
+            static_cast<double>(passes) * kWorkingSetBytes / seconds / 1e9,
+            static_cast<unsigned long long>(sum % 10));
+    }
+}
+
+
+// Number of page faults of the process so far
+size_t PageFaultCount()
+{
+    PROCESS_MEMORY_COUNTERS counters = {};
+    counters.cb = sizeof(counters);
+    ::GetProcessMemoryInfo(::GetCurrentProcess(), &counters, sizeof(counters));
+    return counters.PageFaultCount;
+}
+
+
+// Benchmark large conversions to regular strings and to large-page-backed
+// strings, printing the page faults per conversion
+void BenchmarkLargePageOutput(const char* corpusName, const std::wstring& utf16)
+{
+    const size_t inputBytes = utf16.length() * sizeof(wchar_t);
+    const bool largePages = UnicodeConvStd::EnableLargePages();
+
+    size_t faults = PageFaultCount();
+    size_t calls = Measure(corpusName, "ToUtf8 (std::string)", inputBytes, [&]()
+    {
+        const std::string utf8 = UnicodeConvStd::ToUtf8(utf16);
+    });
+    std::printf("%-12s   (%zu page faults per conversion)\n", "", (PageFaultCount() - faults) / calls);
+
+    faults = PageFaultCount();
+    calls = Measure(corpusName, "ToUtf8LargePages", inputBytes, [&]()
+    {
+        const UnicodeConvStd::LargePageUtf8String utf8 = UnicodeConvStd::ToUtf8LargePages(utf16);
+    });
+    std::printf("%-12s   (%zu page faults per conversion%s)\n", "", (PageFaultCount() - faults) / calls,
+        largePages ? "" : "; large pages not available: regular pages used");
+}
+
+
+// Benchmark the conversions in both directions on the given UTF-16 corpus
+void BenchmarkCorpus(const char* corpusName, const std::wstring& utf16)
+{
+    const std::string utf8 = UnicodeConvStd::ToUtf8(utf16);
+
+    std::string utf8Output;
+    std::wstring utf16Output;
+    utf8Output.reserve(utf8.length());
+    utf16Output.reserve(utf16.length());
+
+    Measure(corpusName, "ToUtf8 (Win32)", utf16.length() * sizeof(wchar_t), [&]()
+    {
+        utf8Output = UnicodeConvStd::ToUtf8(utf16);
+    });
+
+    ResetSelectedKernel();
+    Measure(corpusName, "ToUtf8 to sink (portable engine)", utf16.length() * sizeof(wchar_t), [&]()
+    {
+        utf8Output.clear();
+        StringSink<std::string> sink{ utf8Output };
+        UnicodeConvStd::ToUtf8(utf16, sink);
+    });
+    PrintSelectedKernel();
+
+    Measure(corpusName, "ToUtf16 (Win32)", utf8.length(), [&]()
+    {
+        utf16Output = UnicodeConvStd::ToUtf16(utf8);
+    });
+
+    ResetSelectedKernel();
+    Measure(corpusName, "ToUtf16 to sink (portable engine)", utf8.length(), [&]()
+    {
+        utf16Output.clear();
+        StringSink<std::wstring> sink{ utf16Output };
+        UnicodeConvStd::ToUtf16(utf8, sink);
+    });
+    PrintSelectedKernel();
+}
+
+
+//
+// Benchmark suite with machine-readable (JSON) output
+//
+
+// A corpus of the benchmark suite, in both encodings
+struct SuiteCorpus
+{
+    std::wstring utf16;
+    std::string utf8;
+    size_t codePoints = 0;
+};
+
+
+// Make the given number of UTF-16 code units of a corpus, and its UTF-8 equivalent.
+// With invalidTail, the last sixteenth of the text (at least its last code unit)
+// has an invalid code unit every 8: unpaired surrogates in UTF-16, and 0xFF bytes
+// in UTF-8. The conversions are strict and stop at the first invalid code unit:
+// this measures the validation of the valid part, plus the cost of the rejection.
+SuiteCorpus MakeSuiteCorpus(std::wstring (*makeCorpus)(size_t), size_t length, bool invalidTail)
+{
+    SuiteCorpus corpus;
+    corpus.utf16 = makeCorpus(length);
+    corpus.utf8 = UnicodeConvStd::ToUtf8(corpus.utf16);
+    for (const wchar_t unit : corpus.utf16)
+    {
+        // Count the high surrogates and the BMP code points
+        if (unit < 0xDC00 || unit > 0xDFFF)
+        {
+            ++corpus.codePoints;
+        }
+    }
+
+    if (invalidTail)
+    {
+        const size_t utf16Tail = (std::max)(corpus.utf16.length() / 16, size_t{ 1 });
+        for (size_t i = corpus.utf16.length() - utf16Tail; i < corpus.utf16.length(); i += 8)
+        {
+            // Don't complete a surrogate pair with the low surrogate
+            corpus.utf16[i] = static_cast<wchar_t>(0xDC00);
+            if (i > 0 && corpus.utf16[i - 1] >= 0xD800 && corpus.utf16[i - 1] <= 0xDBFF)
+            {
+                corpus.utf16[i - 1] = L' ';
+            }
+        }
+
+        const size_t utf8Tail = (std::max)(corpus.utf8.length() / 16, size_t{ 1 });
+        for (size_t i = corpus.utf8.length() - utf8Tail; i < corpus.utf8.length(); i += 8)
+        {
+            corpus.utf8[i] = static_cast<char>(0xFF);
+        }
+    }
+    return corpus;
+}
+
+
+// Number of calls, elapsed time and counter increments of a measurement
+struct Timing
+{
+    size_t calls;
+    double seconds;
+    CounterValues counters;
+};
+
+
+// Run the given function repeatedly for at least the minimum time,
+// in batches large enough that the clock reads don't dominate short calls
+template <typename Function>
+Timing TimeCalls(size_t inputBytes, std::chrono::milliseconds minDuration, Function function)
+{
+    using Clock = std::chrono::steady_clock;
+    const size_t batchSize = (std::max)(size_t{ 64 * 1024 } / (std::max)(inputBytes, size_t{ 1 }), size_t{ 1 });
+
+    // Warm up
+    function();
+
+    size_t calls = 0;
+    const CounterValues startCounters = ReadCounters();
+    const auto start = Clock::now();
+    auto elapsed = Clock::duration::zero();
+    do
+    {
+        for (size_t i = 0; i < batchSize; ++i)
+        {
+            function();
+        }
+        calls += batchSize;
+        elapsed = Clock::now() - start;
+    } while (elapsed < minDuration);
+
+    return Timing{ calls, std::chrono::duration<double>(elapsed).count(),
+        CounterDelta(startCounters, ReadCounters()) };
+}
+
+
+// Format the ratio of a counter to a total as a JSON number, or null
+// if the counter isn't available
+std::string JsonRatio(const std::optional<std::uint64_t>& counter, double total)
+{
+    if (!counter || total == 0.0)
+    {
+        return "null";
+    }
+
+    char number[32];
+    std::snprintf(number, sizeof(number), "%.4f", static_cast<double>(*counter) / total);
+    return number;
+}
+
+
+// Print a JSON result record of the benchmark suite.
+// Rejected conversions stop at the invalid sequence: their rates are per
+// input byte, including the bytes after it, and they have no code points/ns.
+void PrintJsonResult(bool first, const char* corpusName, const char* operation,
+    size_t inputBytes, size_t codePoints, bool rejected, const Timing& timing)
+{
+    const double calls = static_cast<double>(timing.calls);
+    const double nanoseconds = timing.seconds * 1e9;
+    const double bytes = static_cast<double>(inputBytes) * calls;
+    const CounterValues& counters = timing.counters;
+    const std::optional<std::uint64_t> convertedCodePoints =
+        rejected ? std::nullopt : std::optional<std::uint64_t>(codePoints);
+    std::printf("%s\n    { \"corpus\": \"%s\", \"operation\": \"%s\", \"inputBytes\": %zu, \"calls\": %zu, "
+        "\"rejected\": %s, \"gbPerSecond\": %.4f, \"codePointsPerNs\": %s, \"nsPerCall\": %.1f, "
+        "\"cyclesPerByte\": %s, \"instructionsPerByte\": %s, \"instructionsPerCycle\": %s, "
+        "\"branchMissesPerByte\": %s, \"l1MissesPerByte\": %s, \"llcMissesPerByte\": %s }",
+        first ? "" : ",", corpusName, operation, inputBytes, timing.calls,
+        rejected ? "true" : "false",
+        bytes / nanoseconds,
+        JsonRatio(convertedCodePoints, nanoseconds / calls).c_str(),
+        nanoseconds / calls,
+        JsonRatio(counters.cycles, bytes).c_str(),
+        JsonRatio(counters.instructions, bytes).c_str(),
+        JsonRatio(counters.instructions, counters.cycles ? static_cast<double>(*counters.cycles) : 0.0).c_str(),
+        JsonRatio(counters.branchMisses, bytes).c_str(),
+        JsonRatio(counters.l1Misses, bytes).c_str(),
+        JsonRatio(counters.llcMisses, bytes).c_str());
+}
+
+
+// Run the benchmark suite: every conversion on every corpus, with UTF-16 input
+// sizes from 8 bytes to maxBytes, multiplying by 8 at each step.
+// The results are printed to stdout as JSON, to compare different versions;
+// the progress is printed to stderr.
+void RunBenchmarkSuite(size_t maxBytes)
+{
+    constexpr auto kMinDuration = std::chrono::milliseconds(200);
+
+    const struct
+    {
+        const char* name;
+        std::wstring (*makeCorpus)(size_t);
+        bool invalidTail;
+    } corpora[] = {
+        { "ASCII", MakeAsciiCorpus, false },
+        { "Latin", MakeLatinCorpus, false },
+        { "Cyrillic", MakeCyrillicCorpus, false },
+        { "CJK", MakeCjkCorpus, false },
+        { "Emoji", MakeEmojiOnlyCorpus, false },
+        { "Mixed", MakeMixedCorpus, false },
+        { "InvalidTail", MakeMixedCorpus, true }
+    };
+
+    std::printf("{\n  \"benchmark\": \"UnicodeConvStd\",\n  \"results\": [");
+    bool first = true;
+    for (const auto& entry : corpora)
+    {
+        for (size_t bytes = 8; bytes <= maxBytes; bytes *= 8)
+        {
+            std::fprintf(stderr, "%s, %zu bytes...\n", entry.name, bytes);
+            const SuiteCorpus corpus = MakeSuiteCorpus(entry.makeCorpus, bytes / sizeof(wchar_t), entry.invalidTail);
+            const size_t utf16Bytes = corpus.utf16.length() * sizeof(wchar_t);
+            const size_t utf8Bytes = corpus.utf8.length();
+
+            // Invalid input throws: measure the rejection, and flag the record
+            const auto run = [&](const char* operation, size_t inputBytes, auto convert)
+            {
+                bool rejected = false;
+                const Timing timing = TimeCalls(inputBytes, kMinDuration, [&]()
+                {
+                    try
+                    {
+                        convert();
+                    }
+                    catch (const UnicodeConvStd::UnicodeConversionException&)
+                    {
+                        rejected = true;
+                    }
+                });
+                PrintJsonResult(first, entry.name, operation, inputBytes, corpus.codePoints, rejected, timing);
+                first = false;
+            };
+
+            std::string utf8Output;
+            std::wstring utf16Output;
+
+            run("ToUtf8", utf16Bytes, [&]() { utf8Output = UnicodeConvStd::ToUtf8(corpus.utf16); });
+            run("ToUtf8Sink", utf16Bytes, [&]()
+            {
+                utf8Output.clear();
+                StringSink<std::string> sink{ utf8Output };
+                UnicodeConvStd::ToUtf8(corpus.utf16, sink);
+            });
+            run("ToUtf8Segmented", utf16Bytes, [&]()
+            {
+                const UnicodeConvStd::SegmentedUtf8 utf8 = UnicodeConvStd::ToUtf8Segmented(corpus.utf16);
+            });
+
+            run("ToUtf16", utf8Bytes, [&]() { utf16Output = UnicodeConvStd::ToUtf16(corpus.utf8); });
+            run("ToUtf16Sink", utf8Bytes, [&]()
+            {
+                utf16Output.clear();
+                StringSink<std::wstring> sink{ utf16Output };
+                UnicodeConvStd::ToUtf16(corpus.utf8, sink);
+            });
+            run("ToUtf16Segmented", utf8Bytes, [&]()
+            {
+                const UnicodeConvStd::SegmentedUtf16 utf16 = UnicodeConvStd::ToUtf16Segmented(corpus.utf8);
+            });
+
+            // The next size would exceed maxBytes: stop here, before bytes * 8
+            // can wrap around (e.g. --max-bytes 1073741824 in 32-bit builds)
+            if (bytes > maxBytes / 8)
+            {
+                break;
+            }
+        }
+    }
+    std::printf("\n  ]\n}\n");
+}
+
+
+//
+// Comparative benchmark against the standard library conversions, and iconv
+//
+
+// Convert from UTF-16 to UTF-8 with wcstombs, in the current (UTF-8) C locale:
+// measure, then convert
+std::string CrtToUtf8(const std::wstring& utf16)
+{
+    const size_t utf8Length = std::wcstombs(nullptr, utf16.c_str(), 0);
+    if (utf8Length == static_cast<size_t>(-1))
+    {
+        throw std::range_error("wcstombs failed.");
+    }
+
+    std::string utf8(utf8Length, ' ');
+    std::wcstombs(utf8.data(), utf16.c_str(), utf8Length);
+    return utf8;
+}
+
+
+// Convert from UTF-8 to UTF-16 with mbstowcs, in the current (UTF-8) C locale:
+// measure, then convert
+std::wstring CrtToUtf16(const std::string& utf8)
+{
+    const size_t utf16Length = std::mbstowcs(nullptr, utf8.c_str(), 0);
+    if (utf16Length == static_cast<size_t>(-1))
+    {
+        throw std::range_error("mbstowcs failed.");
+    }
+
+    std::wstring utf16(utf16Length, L' ');
+    std::mbstowcs(utf16.data(), utf8.c_str(), utf16Length);
+    return utf16;
+}
+
+
+#ifdef UNICODECONVSTD_BENCHMARK_ICONV
+
+// Convert with iconv, to an output sized for the worst case, then trimmed
+template <typename OutputString, typename InputString>
+OutputString IconvConvert(iconv_t converter, const InputString& input, size_t maxOutputLength)
+{
+    using OutputChar = typename OutputString::value_type;
+
+    OutputString output(maxOutputLength, OutputChar{});
+    char* in = const_cast<char*>(reinterpret_cast<const char*>(input.data()));
+    size_t inBytes = input.length() * sizeof(typename InputString::value_type);
+    char* out = reinterpret_cast<char*>(output.data());
+    size_t outBytes = output.length() * sizeof(OutputChar);
+
+    if (iconv(converter, &in, &inBytes, &out, &outBytes) == static_cast<size_t>(-1))
+    {
+        // Reset the conversion state for the next call
+        iconv(converter, nullptr, nullptr, nullptr, nullptr);
+        throw std::range_error("iconv failed.");
+    }
+
+    output.resize(output.length() - outBytes / sizeof(OutputChar));
+    return output;
+}
+
+#endif // UNICODECONVSTD_BENCHMARK_ICONV
+
+
+// Compare the throughput (GB/s of input) and the allocations per call
+// of the conversion methods on the given corpus, side by side
+void BenchmarkComparison(const char* corpusName, const std::wstring& utf16)
+{
+    constexpr auto kMinDuration = std::chrono::milliseconds(200);
+
+    const std::string utf8 = UnicodeConvStd::ToUtf8(utf16);
+    const size_t utf16Bytes = utf16.length() * sizeof(wchar_t);
+    std::string utf8Output;
+    std::wstring utf16Output;
+
+    // Time both directions of a method, counting the allocations
+    const auto compare = [&](const char* methodName, auto toUtf8, auto toUtf16)
+    {
+        const auto measure = [&](size_t inputBytes, auto convert, double& allocationsPerCall)
+        {
+            t_allocationCount = 0;
+            const Timing timing = TimeCalls(inputBytes, kMinDuration, [&]()
+            {
+                const AllocationCountingScope countingScope;
+                convert();
+            });
+
+            // Include the warm-up call
+            allocationsPerCall = static_cast<double>(t_allocationCount)
+                / static_cast<double>(timing.calls + 1);
+            return static_cast<double>(inputBytes) * static_cast<double>(timing.calls) / timing.seconds / 1e9;
+        };
+
+        double toUtf8Allocations = 0.0;
+        double toUtf16Allocations = 0.0;
+        const double toUtf8Speed = measure(utf16Bytes, [&]() { utf8Output = toUtf8(utf16); }, toUtf8Allocations);
+        const double toUtf16Speed = measure(utf8.length(), [&]() { utf16Output = toUtf16(utf8); }, toUtf16Allocations);
+
+        std::printf("%-12s %-30s %8.3f GB/s %6.1f allocs   %8.3f GB/s %6.1f allocs%s\n",
+            corpusName, methodName, toUtf8Speed, toUtf8Allocations, toUtf16Speed, toUtf16Allocations,
+            (utf8Output == utf8 && utf16Output == utf16) ? "" : "   (output mismatch)");
+    };
+
+    compare("UnicodeConvStd (Win32)",
+        [](const std::wstring& text) { return UnicodeConvStd::ToUtf8(text); },
+        [](const std::string& text) { return UnicodeConvStd::ToUtf16(text); });
+
+    compare("UnicodeConvStd (sink)",
+        [](const std::wstring& text)
+        {
+            std::string output;
+            StringSink<std::string> sink{ output };
+            UnicodeConvStd::ToUtf8(text, sink);
+            return output;
+        },
+        [](const std::string& text)
+        {
+            std::wstring output;
+            StringSink<std::wstring> sink{ output };
+            UnicodeConvStd::ToUtf16(text, sink);
+            return output;
+        });
+
+    std::wstring_convert<std::codecvt_utf8_utf16<wchar_t>, wchar_t> codecvtConverter;
+    compare("wstring_convert/codecvt",
+        [&codecvtConverter](const std::wstring& text) { return codecvtConverter.to_bytes(text); },
+        [&codecvtConverter](const std::string& text) { return codecvtConverter.from_bytes(text); });
+
+    compare("wcstombs/mbstowcs", CrtToUtf8, CrtToUtf16);
+
+#ifdef UNICODECONVSTD_BENCHMARK_ICONV
+    const char* const utf16Encoding = (sizeof(wchar_t) == 2) ? "UTF-16LE" : "UTF-32LE";
+    const iconv_t toUtf8Converter = iconv_open("UTF-8", utf16Encoding);
+    const iconv_t toUtf16Converter = iconv_open(utf16Encoding, "UTF-8");
+    const iconv_t failedOpen = reinterpret_cast<iconv_t>(-1);
+    if (toUtf8Converter != failedOpen && toUtf16Converter != failedOpen)
+    {
+        compare("iconv",
+            [toUtf8Converter](const std::wstring& text)
+            {
+                return IconvConvert<std::string>(toUtf8Converter, text, 3 * text.length());
+            },
+            [toUtf16Converter](const std::string& text)
+            {
+                return IconvConvert<std::wstring>(toUtf16Converter, text, text.length());
+            });
+    }
+    else
+    {
+        // This iconv doesn't support the encodings
+        std::printf("%-12s %-30s (not available)\n", corpusName, "iconv");
+    }
+
+    if (toUtf8Converter != failedOpen)
+    {
+        iconv_close(toUtf8Converter);
+    }
+    if (toUtf16Converter != failedOpen)
+    {
+        iconv_close(toUtf16Converter);
+    }
+#else
+    std::printf("%-12s %-30s (not available)\n", corpusName, "iconv");
+#endif
+}
+
+
+// Run the comparative benchmark on short and large texts of each corpus
+void RunComparison()
+{
+    // wcstombs and mbstowcs convert from and to UTF-8 in a UTF-8 locale
+    if (std::setlocale(LC_CTYPE, ".UTF8") == nullptr && std::setlocale(LC_CTYPE, "C.UTF-8") == nullptr)
+    {
+        std::printf("(UTF-8 C locale not available: wcstombs/mbstowcs results are not valid)\n");
+    }
+
+    const struct
+    {
+        const char* name;
+        std::wstring (*makeCorpus)(size_t);
+    } corpora[] = {
+        { "ASCII", MakeAsciiCorpus },
+        { "Latin", MakeLatinCorpus },
+        { "Cyrillic", MakeCyrillicCorpus },
+        { "CJK", MakeCjkCorpus },
+        { "Emoji", MakeEmojiOnlyCorpus },
+        { "Mixed", MakeMixedCorpus }
+    };
+
+    std::printf("%-12s %-30s %-31s %s\n", "Corpus", "Method", "UTF-16 to UTF-8", "UTF-8 to UTF-16");
+    for (const size_t length : { size_t{ 32 }, size_t{ 1024 * 1024 } })
+    {
+        std::printf("\n%zu UTF-16 code units:\n", length);
+        for (const auto& entry : corpora)
+        {
+            BenchmarkComparison(entry.name, entry.makeCorpus(length));
+        }
+    }
+}
+
+
+//
+// Latency of short conversions, with tail percentiles
+//
+
+// Read the time stamp counter, without letting the CPU reorder
+// the timed code across the read
+std::uint64_t ReadTimeStamp()
+{
+    _mm_lfence();
+    const std::uint64_t timeStamp = __rdtsc();
+    _mm_lfence();
+    return timeStamp;
+}
+
+
+// Time stamp counter ticks per nanosecond, measured against the steady clock
+double TimeStampTicksPerNanosecond()
+{
+    using Clock = std::chrono::steady_clock;
+
+    const auto start = Clock::now();
+    const std::uint64_t startTicks = ReadTimeStamp();
+    while (Clock::now() - start < std::chrono::milliseconds(200))
+    {
+    }
+    const std::uint64_t ticks = ReadTimeStamp() - startTicks;
+    const double nanoseconds = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+    return static_cast<double>(ticks) / nanoseconds;
+}
+
+
+// Calibration of the per-call timing
+struct LatencyCalibration
+{
+    double ticksPerNanosecond;
+    std::uint64_t overheadTicks;    // Median cost of an empty timed region
+};
+
+
+// Time each call of function(i), for i in [0, calls), and print the
+// 50th, 90th, 99th and 99.9th percentiles of the latency in ns per call
+template <typename Function>
+void MeasureLatencyPercentiles(const char* caseName, size_t calls,
+    const LatencyCalibration& calibration, Function function)
+{
+    std::vector<std::uint64_t> ticks(calls);
+    for (size_t i = 0; i < calls; ++i)
+    {
+        const std::uint64_t start = ReadTimeStamp();
+        function(i);
+        const std::uint64_t elapsed = ReadTimeStamp() - start;
+        ticks[i] = (elapsed > calibration.overheadTicks) ? elapsed - calibration.overheadTicks : 0;
+    }
+    std::sort(ticks.begin(), ticks.end());
+
+    const auto percentile = [&](double fraction)
+    {
+        const size_t index = (std::min)(static_cast<size_t>(fraction * static_cast<double>(calls)), calls - 1);
+        return static_cast<double>(ticks[index]) / calibration.ticksPerNanosecond;
+    };
+
+    std::printf("%-40s p50 %7.1f   p90 %7.1f   p99 %7.1f   p99.9 %8.1f ns\n", caseName,
+        percentile(0.5), percentile(0.9), percentile(0.99), percentile(0.999));
+}
+
+
+// Sink that copies the output to a fixed buffer, with no allocations
+template <typename CharType>
+struct FixedBufferSink
+{
+    CharType* buffer;
+    size_t length;
+
+    void write(const CharType* data, size_t count)
+    {
+        std::copy(data, data + count, buffer + length);
+        length += count;
+    }
+};
+
+
+// Run the short string latency benchmark: calls conversions of random
+// slices (1 to 64 UTF-16 code units) of mixed text, per case.
+// Warm cache: the slices come from a small pool, that stays in the cache.
+// Cold cache: the slices come from a pool much larger than the last-level
+// cache, visited in random order, so their text is usually not in the cache.
+// Returned string: ToUtf8/ToUtf16 return a new string, that is allocated only
+// beyond the SSO capacity, so the slices within it are timed separately.
+// Sink: the output goes through a sink to a fixed buffer, with no allocations.
+// The thread is pinned to its current CPU, to avoid migrations.
+void RunLatencyBenchmark(size_t calls)
+{
+    constexpr size_t kMaxSliceLength = 64;
+    constexpr size_t kWarmPoolSize = 64;
+    constexpr size_t kColdPoolSize = 1024 * 1024;
+
+    const DWORD cpu = ::GetCurrentProcessorNumber();
+    if (cpu < 8 * sizeof(DWORD_PTR)
+        && ::SetThreadAffinityMask(::GetCurrentThread(), DWORD_PTR{ 1 } << cpu) != 0)
+    {
+        std::printf("Pinned to CPU %lu.\n", static_cast<unsigned long>(cpu));
+    }
+    else
+    {
+        std::printf("(Thread not pinned to a CPU.)\n");
+    }
+
+    LatencyCalibration calibration{ TimeStampTicksPerNanosecond(), 0 };
+    {
+        std::vector<std::uint64_t> emptyTicks(10000);
+        for (std::uint64_t& elapsed : emptyTicks)
+        {
+            const std::uint64_t start = ReadTimeStamp();
+            elapsed = ReadTimeStamp() - start;
+        }
+        std::sort(emptyTicks.begin(), emptyTicks.end());
+        calibration.overheadTicks = emptyTicks[emptyTicks.size() / 2];
+    }
+
+    // The slices of the text, in both encodings
+    std::mt19937 random(2023);
+    const std::wstring text = MakeMixedCorpus(1024 * 1024);
+    const auto makePool = [&](size_t size, std::vector<std::wstring>& utf16Pool, std::vector<std::string>& utf8Pool)
+    {
+        utf16Pool.reserve(size);
+        utf8Pool.reserve(size);
+        for (size_t i = 0; i < size; ++i)
+        {
+            // Don't split surrogate pairs
+            size_t begin = random() % (text.length() - kMaxSliceLength - 1);
+            if (text[begin] >= 0xDC00 && text[begin] <= 0xDFFF)
+            {
+                ++begin;
+            }
+            size_t end = begin + 1 + random() % kMaxSliceLength;
+            if (text[end - 1] >= 0xD800 && text[end - 1] <= 0xDBFF)
+            {
+                end += (end - begin == 1) ? 1 : -1;
+            }
+
+            utf16Pool.push_back(text.substr(begin, end - begin));
+            utf8Pool.push_back(UnicodeConvStd::ToUtf8(utf16Pool.back()));
+        }
+    };
+
+    std::vector<std::wstring> warmUtf16;
+    std::vector<std::string> warmUtf8;
+    makePool(kWarmPoolSize, warmUtf16, warmUtf8);
+    std::vector<std::wstring> coldUtf16;
+    std::vector<std::string> coldUtf8;
+    makePool(kColdPoolSize, coldUtf16, coldUtf8);
+
+    // Order of the slices for each call
+    std::vector<std::uint32_t> warmOrder(calls);
+    std::vector<std::uint32_t> coldOrder(calls);
+    for (size_t i = 0; i < calls; ++i)
+    {
+        warmOrder[i] = static_cast<std::uint32_t>(i % kWarmPoolSize);
+        coldOrder[i] = static_cast<std::uint32_t>(i % kColdPoolSize);
+    }
+    std::shuffle(warmOrder.begin(), warmOrder.end(), random);
+    std::shuffle(coldOrder.begin(), coldOrder.end(), random);
+
+    char utf8Buffer[3 * kMaxSliceLength];
+    wchar_t utf16Buffer[3 * kMaxSliceLength];
+
+    const struct
+    {
+        const char* name;
+        const std::vector<std::wstring>& utf16Pool;
+        const std::vector<std::string>& utf8Pool;
+        const std::vector<std::uint32_t>& order;
+    } caches[] = {
+        { "warm", warmUtf16, warmUtf8, warmOrder },
+        { "cold", coldUtf16, coldUtf8, coldOrder }
+    };
+
+    // Returned strings up to these lengths don't allocate
+    const size_t utf8SsoCapacity = std::string().capacity();
+    const size_t utf16SsoCapacity = std::wstring().capacity();
+
+    std::printf("%zu calls per case, 1 to %zu UTF-16 code units per call\n", calls, kMaxSliceLength);
+    std::printf("(the calls returning a string are split by the SSO capacity: %zu chars, %zu wchar_ts)\n\n",
+        utf8SsoCapacity, utf16SsoCapacity);
+    char caseName[64];
+    for (const auto& cache : caches)
+    {
+        // Time convert(slice) separately for the slices whose output fits
+        // the SSO capacity, and for the ones whose output is allocated
+        const auto measureReturnedString = [&](const char* operation, size_t ssoCapacity,
+            auto outputLength, auto convert)
+        {
+            std::vector<std::uint32_t> ssoOrder;
+            std::vector<std::uint32_t> allocationOrder;
+            for (const std::uint32_t slice : cache.order)
+            {
+                (outputLength(slice) > ssoCapacity ? allocationOrder : ssoOrder).push_back(slice);
+            }
+
+            const struct
+            {
+                const char* name;
+                const std::vector<std::uint32_t>& order;
+            } groups[] = {
+                { "SSO, no allocation", ssoOrder },
+                { "allocation", allocationOrder }
+            };
+
+            for (const auto& group : groups)
+            {
+                if (group.order.empty())
+                {
+                    continue;
+                }
+
+                std::snprintf(caseName, sizeof(caseName), "%s (%s, %s)", operation, cache.name, group.name);
+                MeasureLatencyPercentiles(caseName, group.order.size(), calibration, [&](size_t i)
+                {
+                    convert(group.order[i]);
+                });
+            }
+        };
+
+        measureReturnedString("ToUtf8", utf8SsoCapacity,
+            [&](std::uint32_t slice) { return cache.utf8Pool[slice].length(); },
+            [&](std::uint32_t slice)
+            {
+                const std::string utf8 = UnicodeConvStd::ToUtf8(cache.utf16Pool[slice]);
+            });
+
+        std::snprintf(caseName, sizeof(caseName), "ToUtf8 to sink (%s, no allocation)", cache.name);
+        MeasureLatencyPercentiles(caseName, calls, calibration, [&](size_t i)
+        {
+            FixedBufferSink<char> sink{ utf8Buffer, 0 };
+            UnicodeConvStd::ToUtf8(cache.utf16Pool[cache.order[i]], sink);
+        });
+
+        measureReturnedString("ToUtf16", utf16SsoCapacity,
+            [&](std::uint32_t slice) { return cache.utf16Pool[slice].length(); },
+            [&](std::uint32_t slice)
+            {
+                const std::wstring utf16 = UnicodeConvStd::ToUtf16(cache.utf8Pool[slice]);
+            });
+
+        std::snprintf(caseName, sizeof(caseName), "ToUtf16 to sink (%s, no allocation)", cache.name);
+        MeasureLatencyPercentiles(caseName, calls, calibration, [&](size_t i)
+        {
+            FixedBufferSink<wchar_t> sink{ utf16Buffer, 0 };
+            UnicodeConvStd::ToUtf16(cache.utf8Pool[cache.order[i]], sink);
+        });
+    }
+}
+
+
+//
+// Multi-threaded scaling
+//
+
+// Run function(threadIndex), that returns the number of input bytes it
+// converted, repeatedly on threadCount threads started together, for at least
+// the minimum time. Returns the aggregate throughput in GB/s.
+template <typename Function>
+double MeasureParallelThroughput(size_t threadCount, Function function)
+{
+    using Clock = std::chrono::steady_clock;
+    constexpr auto kMinDuration = std::chrono::milliseconds(500);
+
+    std::atomic<size_t> readyCount{ 0 };
+    std::atomic<bool> start{ false };
+    std::atomic<bool> stop{ false };
+    std::vector<std::uint64_t> threadBytes(threadCount, 0);
+
+    std::vector<std::thread> threads;
+    for (size_t threadIndex = 0; threadIndex < threadCount; ++threadIndex)
+    {
+        threads.emplace_back([&, threadIndex]()
+        {
+            // Warm up, then wait for the other threads
+            function(threadIndex);
+            ++readyCount;
+            while (!start.load())
+            {
+                std::this_thread::yield();
+            }
+
+            std::uint64_t bytes = 0;
+            while (!stop.load(std::memory_order_relaxed))
+            {
+                bytes += function(threadIndex);
+            }
+            threadBytes[threadIndex] = bytes;
+        });
+    }
+
+    while (readyCount.load() != threadCount)
+    {
+        std::this_thread::yield();
+    }
+    const auto startTime = Clock::now();
+    start = true;
+    std::this_thread::sleep_for(kMinDuration);
+    stop = true;
+    for (std::thread& thread : threads)
+    {
+        thread.join();
+    }
+    const double seconds = std::chrono::duration<double>(Clock::now() - startTime).count();
+
+    std::uint64_t totalBytes = 0;
+    for (const std::uint64_t bytes : threadBytes)
+    {
+        totalBytes += bytes;
+    }
+    return static_cast<double>(totalBytes) / seconds / 1e9;
+}
+
+
+// Run the scaling benchmark, from 1 thread to maxThreads (doubling, then
+// maxThreads), printing the aggregate throughput, and the efficiency per
+// thread relative to the single thread run.
+// Independent conversions: each thread converts its own strings, with
+// ToUtf8, and with the sink-based ToUtf8 to a newly allocated string or to
+// a per-thread buffer: the difference between the last two is the cost of
+// the allocator (e.g. contention on the heap).
+// Large parallel conversion: a 128 MB text is split among the threads,
+// that convert their slices to per-thread buffers (memory bandwidth bound).
+void RunScalingBenchmark(size_t maxThreads)
+{
+    constexpr size_t kLargeTextLength = 64 * 1024 * 1024;
+
+    const std::wstring shortText = MakeMixedCorpus(64);
+    const std::wstring mediumText = MakeMixedCorpus(16 * 1024);
+    const std::wstring largeText = MakeMixedCorpus(kLargeTextLength);
+
+    std::vector<size_t> threadCounts;
+    for (size_t threadCount = 1; threadCount < maxThreads; threadCount *= 2)
+    {
+        threadCounts.push_back(threadCount);
+    }
+    threadCounts.push_back(maxThreads);
+
+    // Per-thread output buffers, large enough for any slice of the large text
+    std::vector<std::vector<char>> buffers(maxThreads);
+
+    const auto runCase = [&](const char* caseName, auto makeFunction)
+    {
+        double singleThreadSpeed = 0.0;
+        for (const size_t threadCount : threadCounts)
+        {
+            const double speed = MeasureParallelThroughput(threadCount, makeFunction(threadCount));
+            if (threadCount == 1)
+            {
+                singleThreadSpeed = speed;
+            }
+
+            const double efficiency = speed / (singleThreadSpeed * static_cast<double>(threadCount));
+            std::printf("%-44s %3zu threads %8.3f GB/s %6.1f%% efficiency\n",
+                caseName, threadCount, speed, 100.0 * efficiency);
+        }
+    };
+
+    const struct
+    {
+        const char* name;
+        const std::wstring& text;
+    } independentCases[] = {
+        { "64 units", shortText },
+        { "16K units", mediumText }
+    };
+
+    char caseName[64];
+    for (const auto& entry : independentCases)
+    {
+        const std::wstring& text = entry.text;
+        const size_t inputBytes = text.length() * sizeof(wchar_t);
+        for (std::vector<char>& buffer : buffers)
+        {
+            buffer.resize(3 * text.length());
+        }
+
+        std::snprintf(caseName, sizeof(caseName), "ToUtf8, %s", entry.name);
+        runCase(caseName, [&](size_t)
+        {
+            return [&](size_t)
+            {
+                const std::string utf8 = UnicodeConvStd::ToUtf8(text);
+                return inputBytes;
+            };
+        });
+
+        std::snprintf(caseName, sizeof(caseName), "ToUtf8 to sink, %s (allocation)", entry.name);
+        runCase(caseName, [&](size_t)
+        {
+            return [&](size_t)
+            {
+                std::string utf8;
+                utf8.reserve(3 * text.length());
+                StringSink<std::string> sink{ utf8 };
+                UnicodeConvStd::ToUtf8(text, sink);
+                return inputBytes;
+            };
+        });
+
+        std::snprintf(caseName, sizeof(caseName), "ToUtf8 to sink, %s (no allocation)", entry.name);
+        runCase(caseName, [&](size_t)
+        {
+            return [&](size_t threadIndex)
+            {
+                FixedBufferSink<char> sink{ buffers[threadIndex].data(), 0 };
+                UnicodeConvStd::ToUtf8(text, sink);
+                return inputBytes;
+            };
+        });
+    }
+
+    runCase("Large parallel ToUtf8 to sink (128 MB)", [&](size_t threadCount)
+    {
+        // Split the text in slices, without splitting surrogate pairs
+        std::vector<std::wstring_view> slices;
+        size_t begin = 0;
+        for (size_t i = 1; i <= threadCount; ++i)
+        {
+            size_t end = largeText.length() * i / threadCount;
+            if (end < largeText.length() && largeText[end - 1] >= 0xD800 && largeText[end - 1] <= 0xDBFF)
+            {
+                --end;
+            }
+            slices.push_back(std::wstring_view(largeText).substr(begin, end - begin));
+            buffers[i - 1].resize(3 * (end - begin));
+            begin = end;
+        }
+
+        return [&, slices](size_t threadIndex)
+        {
+            FixedBufferSink<char> sink{ buffers[threadIndex].data(), 0 };
+            UnicodeConvStd::ToUtf8(slices[threadIndex], sink);
+            return slices[threadIndex].length() * sizeof(wchar_t);
+        };
+    });
+}
+
+
+//
+// Usage:
+//
+//      BenchmarkUnicodeConvStd
+//          Run the benchmarks, printing the results as a table
+//
+//      BenchmarkUnicodeConvStd --json [--max-bytes N]
+//          Run the benchmark suite, printing the results as JSON
+//          (input sizes up to N bytes: 1 GB by default on 64-bit builds)
+//
+//      BenchmarkUnicodeConvStd --compare
+//          Compare the throughput and the allocations per call with
+//          std::wstring_convert, wcstombs/mbstowcs, and iconv if available
+//
+//      BenchmarkUnicodeConvStd --latency [--calls N]
+//          Measure the latency percentiles of short conversions
+//          (N calls per case: 2 million by default)
+//
+//      BenchmarkUnicodeConvStd --scaling [--threads N]
+//          Measure the throughput scaling from 1 to N threads
+//          (all the logical CPUs by default)
+//
+int main(int argc, char* argv[])
+{
+#ifdef _WIN64
+    size_t maxSuiteBytes = 1024 * 1024 * 1024;
+#else
+    size_t maxSuiteBytes = 64 * 1024 * 1024;
+#endif
+    bool runSuite = false;
+    bool runComparison = false;
+    bool runLatency = false;
+    size_t latencyCalls = 2'000'000;
+    bool runScaling = false;
+    size_t maxThreads = (std::max)(std::thread::hardware_concurrency(), 1u);
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string arg = argv[i];
+        if (arg == "--json")
+        {
+            runSuite = true;
+        }
+        else if (arg == "--compare")
+        {
+            runComparison = true;
+        }
+        else if (arg == "--latency")
+        {
+            runLatency = true;
+        }
+        else if (arg == "--calls" && i + 1 < argc)
+        {
+            latencyCalls = static_cast<size_t>(std::strtoull(argv[++i], nullptr, 10));
+        }
+        else if (arg == "--scaling")
+        {
+            runScaling = true;
+        }
+        else if (arg == "--threads" && i + 1 < argc)
+        {
+            maxThreads = (std::max)(static_cast<size_t>(std::strtoull(argv[++i], nullptr, 10)), size_t{ 1 });
+        }
+        else if (arg == "--max-bytes" && i + 1 < argc)
+        {
+            maxSuiteBytes = static_cast<size_t>(std::strtoull(argv[++i], nullptr, 10));
+        }
+    }
+
+    if (runSuite)
+    {
+        RunBenchmarkSuite(maxSuiteBytes);
+        return 0;
+    }
+
+    if (runComparison)
+    {
+        RunComparison();
+        return 0;
+    }
+
+    if (runLatency)
+    {
+        RunLatencyBenchmark(latencyCalls);
+        return 0;
+    }
+
+    if (runScaling)
+    {
+        RunScalingBenchmark(maxThreads);
+        return 0;
+    }
+
+    std::printf("*** Benchmark Unicode UTF-16/UTF-8 Conversion Functions *** \n\n");
+
+    constexpr size_t kCorpusLength = 1024 * 1024;   // in wchar_ts
+
+    BenchmarkCorpus("ASCII", MakeAsciiCorpus(kCorpusLength));
+    BenchmarkCorpus("EmojiChat", MakeEmojiChatCorpus(kCorpusLength));
+    BenchmarkCorpus("EmojiOnly", MakeEmojiOnlyCorpus(kCorpusLength));
+    BenchmarkCorpus("CJK", MakeCjkCorpus(kCorpusLength));
+    BenchmarkCorpus("Cyrillic", MakeCyrillicCorpus(kCorpusLength));
+
+    std::printf("\n");
+    constexpr size_t kLargeCorpusLength = 64 * 1024 * 1024;   // in wchar_ts
+    BenchmarkLargeOutput("LargeASCII", MakeAsciiCorpus(kLargeCorpusLength));
+    BenchmarkLargeOutput("LargeCJK", MakeCjkCorpus(kLargeCorpusLength));
+
+    std::printf("\n");
+    BenchmarkLargePageOutput("LargeCJK", MakeCjkCorpus(kLargeCorpusLength));
+
+    std::printf("\n");
+    BenchmarkCoRunningWorkload("LargeCJK", MakeCjkCorpus(kLargeCorpusLength));
+
+    std::printf("\n");
+    BenchmarkShortStrings();
+}